@@ -1,7 +1,9 @@
 #include "AngleCorrection.h"
 
 #include "spline3d.hpp"
+#include "centerline_hash.hpp"
 #include "ErrorHandler.hpp"
+#include "task_scheduler.hpp"
 #include <vtkDoubleArray.h>
 #include <vtkSmartPointer.h>
 
@@ -10,6 +12,10 @@
 #include <vtkPolyDataWriter.h>
 #include <vtkPointData.h>
 
+#include <algorithm>
+
+//#define DEBUG_SPLINE_CACHE
+
 using namespace std;
 
 
@@ -21,43 +27,128 @@ using namespace std;
 *
 */
 
-AngleCorrection::AngleCorrection(){
+template<typename T>
+AngleCorrectionT<T>::AngleCorrectionT(){
     mOutput = NULL;
     mValidInput= false;
-    mClSplinesPtr = new vectorSpline3dDouble();
-    mVelDataPtr = new vector<MetaImage<inData_t>>();
-    mClData=vtkSmartPointer<vtkPolyData>::New();
+    mParsedSplinesPtr = new SplineVector();
+    mClSplinesPtr = new SplineVector();
+    mClInput = NULL;
+    mClData = NULL;
+    mClMTime = 0;
+    mClSnapshotMTime = 0;
+    mClHash = 0;
+    mSmoothedWith = -1;
+    mGrownAllCrossings = false;
+    mPreviousSmoothedWith = -1;
+    mPreviousAllCrossings = false;
+    mReusedAllCrossings = false;
+    mReusedFromCache = false;
     mVelImagePrefix="";
     mIntersections =  0;
     mBloodVessels = 0;
+    mBloodVesselsSmoothed = 0;
+    mBloodVesselsIntersected = 0;
     mNumOfStepsRan=0;
     mVnyq=0;
     mCutoff=0;
     mnConvolutions=0;
     mUncertainty_limit=0;
     mMinArrowDist=0;
+    mAllCrossings = false;
     mBloodVesselsRemoved = 0;
-    mUpdate1=true;
-    mUpdate2=true;
+    mProgress = std::make_shared<CalculationProgress>();
+    mCancelled = false;
+    buildPipeline();
+}
+
+
+/**
+* Move constructor.
+* The stages of the pipeline refer to the instance they belong to,
+* so the new instance keeps its own pipeline, which will run in full on the next calculate()
+*/
+template<typename T>
+AngleCorrectionT<T>::AngleCorrectionT(AngleCorrectionT&& other) : AngleCorrectionT()
+{
+    *this = std::move(other);
+}
+
+
+template<typename T>
+AngleCorrectionT<T>& AngleCorrectionT<T>::operator=(AngleCorrectionT&& other)
+{
+    std::swap(mParsedSplinesPtr, other.mParsedSplinesPtr);
+    std::swap(mClSplinesPtr, other.mClSplinesPtr);
+    std::swap(mFrames, other.mFrames);
+    std::swap(mClInput, other.mClInput);
+    std::swap(mClData, other.mClData);
+    std::swap(mSplineCache, other.mSplineCache);
+    mClMTime = other.mClMTime;
+    mClSnapshotMTime = other.mClSnapshotMTime;
+    mClHash = other.mClHash;
+    mSmoothedWith = -1;
+    mGrownFrames.reset();
+    mPreviousSplines.clear();
+    mBranchReused.clear();
+    mReusedFromCache = false;
+    mVelImagePrefix = other.mVelImagePrefix;
+    mVnyq = other.mVnyq;
+    mCutoff = other.mCutoff;
+    mnConvolutions = other.mnConvolutions;
+    mUncertainty_limit = other.mUncertainty_limit;
+    mMinArrowDist = other.mMinArrowDist;
+    mAllCrossings = other.mAllCrossings;
+    mOutput = other.mOutput;
+    mValidInput = other.mValidInput;
+    mIntersections = other.mIntersections;
+    mBloodVessels = other.mBloodVessels;
+    mBloodVesselsSmoothed = other.mBloodVesselsSmoothed;
+    mBloodVesselsIntersected = other.mBloodVesselsIntersected;
+    mNumOfStepsRan = other.mNumOfStepsRan;
+    mBloodVesselsRemoved = other.mBloodVesselsRemoved;
+    mPipeline.invalidateAll();
+    return *this;
 }
 
 
-AngleCorrection::~AngleCorrection(){
+template<typename T>
+AngleCorrectionT<T>::~AngleCorrectionT(){
+    if(mCalculation.valid())
+    {
+        cancel();
+        mCalculation.wait();
+    }
+
+    mParsedSplinesPtr->clear();
+    delete mParsedSplinesPtr;
+
     mClSplinesPtr->clear();
     delete mClSplinesPtr;
+}
 
-    mVelDataPtr->clear();
-    delete mVelDataPtr;
 
-    mOutput = NULL;
-    mValidInput= false;
-    mClSplinesPtr = new vectorSpline3dDouble();
-    mVelDataPtr = new vector<MetaImage<inData_t>>();
-    mClData=vtkSmartPointer<vtkPolyData>::New();
-    mVelImagePrefix="";
-    mIntersections =  0;
-    mBloodVessels = 0;
-    mNumOfStepsRan=0;
+/**
+* Set up the stages of the algorithm as a dependency graph.
+* Frame loading and the centerline stages are independent and run concurrently,
+* and after a change of input only the stages depending on that input are run again.
+*/
+template<typename T>
+void AngleCorrectionT<T>::buildPipeline()
+{
+    mFrameLoadNode = mPipeline.addNode("frame load", [this](){ loadFrames(); });
+    mCenterlineParseNode = mPipeline.addNode("centerline parse", [this](){ parseCenterline(); });
+    mSplineBuildNode = mPipeline.addNode("spline build", [this](){ buildSplines(); }, {mCenterlineParseNode});
+    mSmoothingNode = mPipeline.addNode("smoothing", [this](){ smoothSplines(); }, {mSplineBuildNode});
+    mFittingNode = mPipeline.addNode("fitting", [this](){ fitSplines(); }, {mSmoothingNode});
+    mIntersectionNode = mPipeline.addNode("intersection", [this](){ findIntersections(); }, {mFittingNode, mFrameLoadNode});
+    mRegionGrowingNode = mPipeline.addNode("region growing", [this](){ growRegions(); }, {mIntersectionNode});
+    mDirectionNode = mPipeline.addNode("direction estimation", [this](){ estimateDirections(); }, {mRegionGrowingNode});
+    mAliasingNode = mPipeline.addNode("aliasing correction", [this](){ correctAliasing(); }, {mDirectionNode});
+    mVelocityNode = mPipeline.addNode("LS velocity", [this](){ estimateVelocities(); }, {mAliasingNode});
+    mOutputNode = mPipeline.addNode("output generation", [this](){
+        mOutput = computeVtkPolyData(mClSplinesPtr, mUncertainty_limit, mMinArrowDist);
+    }, {mVelocityNode});
 }
 
   /**
@@ -70,10 +161,17 @@ AngleCorrection::~AngleCorrection(){
 * @param nConvolutions - smoothning of the blood vessel spline
 * @param uncertainty_limit - lower value for reject vessel segment
 * @param minArrowDist - min distance between visualization arrows
+*
+* The centerline is not copied. The calculation reads a shallow copy of it, sharing its
+* point and line arrays, so its points and lines may be replaced at any time.
+* The shared arrays must not be changed in place while a calculation runs, which is reported as an error.
+* Changes made in place before calculate() are seen through its modification time.
 */
-void AngleCorrection::setInput(vtkSmartPointer<vtkPolyData> vpd_centerline, vector<MetaImage<inData_t> >* velData, double Vnyq, double cutoff, int nConvolutions, double uncertainty_limit, double minArrowDist)
+template<typename T>
+void AngleCorrectionT<T>::setInput(vtkSmartPointer<vtkPolyData> vpd_centerline, double Vnyq, double cutoff, int nConvolutions, double uncertainty_limit, double minArrowDist)
 {
     mValidInput= false;
+    mProgress->reset();
     if (uncertainty_limit < 0.0) reportError("ERROR: uncertainty_limit must be positive ");
     if (minArrowDist < 0.0) reportError("ERROR: minArrowDist must be positive ");
     if (Vnyq < 0.0) reportError("ERROR: vNyquist must be positive ");
@@ -81,23 +179,27 @@ void AngleCorrection::setInput(vtkSmartPointer<vtkPolyData> vpd_centerline, vect
     if (vpd_centerline->GetNumberOfPoints()<=0) reportError("ERROR: No points found in the center line ");
     if (vpd_centerline->GetNumberOfLines()<=0) reportError("ERROR: No lines found in the center line, the center line must be a linked list ");
 
-    if((velData->size() > 0 && mVelDataPtr!=velData) || mVelImagePrefix.size()==0)
+    if(updateCenterline(vpd_centerline))
     {
-        mVelDataPtr->clear();
-        mVelDataPtr=velData;
-        mUpdate1=true;
+        mPipeline.invalidate(mCenterlineParseNode);
     }
 
-    if(mVnyq!=Vnyq ||
-            mCutoff!=cutoff ||
-            mnConvolutions!=nConvolutions ||
-            !EqualVtkPolyData(mClData,vpd_centerline))
+    // Every parameter only invalidates the stages using it, and the stages after them.
+    // Smoothing works in place on the splines, so it starts over from the spline build
+    if(mnConvolutions!=nConvolutions)
+    {
+        mnConvolutions=nConvolutions;
+        mPipeline.invalidate(mSplineBuildNode);
+    }
+    if(mVnyq!=Vnyq)
     {
-        mClData->DeepCopy(vpd_centerline);
         mVnyq=Vnyq;
+        mPipeline.invalidate(mAliasingNode);
+    }
+    if(mCutoff!=cutoff)
+    {
         mCutoff=cutoff;
-        mnConvolutions=nConvolutions;
-        mUpdate1=true;
+        mPipeline.invalidate(mVelocityNode);
     }
 
     if(mUncertainty_limit!=uncertainty_limit ||
@@ -105,19 +207,49 @@ void AngleCorrection::setInput(vtkSmartPointer<vtkPolyData> vpd_centerline, vect
     {
         mUncertainty_limit=uncertainty_limit;
         mMinArrowDist=minArrowDist;
-        mUpdate2=true;
+        mPipeline.invalidate(mOutputNode);
     }
     mValidInput= true;
 }
 
 
-void AngleCorrection::setInput(vtkSmartPointer<vtkPolyData> vpd_centerline, const  char* velImagePrefix , double Vnyq, double cutoff, int nConvolutions, double uncertainty_limit, double minArrowDist)
+/**
+* Set how many earlier results of the centerline stages are kept, see SplineCache.
+* Going back to a centerline and smoothing level that is still in the cache
+* skips smoothing, fitting, intersection and region growing. 0 turns the cache off.
+* @param capacity - number of results to keep
+*/
+template<typename T>
+void AngleCorrectionT<T>::setSplineCacheCapacity(size_t capacity)
+{
+    mSplineCache.setCapacity(capacity);
+}
+
+
+/**
+* Choose between using only the first crossing of each blood vessel with each frame (the default),
+* or every crossing, for vessels that wind through a frame several times.
+* Takes effect on the next calculate(), from the intersection stage on.
+* @param allCrossings - true to use every crossing
+*/
+template<typename T>
+void AngleCorrectionT<T>::setReportAllCrossings(bool allCrossings)
+{
+    if(mAllCrossings!=allCrossings)
+    {
+        mAllCrossings=allCrossings;
+        mPipeline.invalidate(mIntersectionNode);
+    }
+}
+
+
+template<typename T>
+void AngleCorrectionT<T>::setInput(vtkSmartPointer<vtkPolyData> vpd_centerline, const  char* velImagePrefix , double Vnyq, double cutoff, int nConvolutions, double uncertainty_limit, double minArrowDist)
 {
     if(mVelImagePrefix!=std::string(velImagePrefix))
     {
         mVelImagePrefix=std::string(velImagePrefix);
-        mVelDataPtr->clear();
-        mUpdate1=true;
+        mPipeline.invalidate(mFrameLoadNode);
     }
 
     std::string filename=std::string(velImagePrefix);
@@ -134,11 +266,12 @@ void AngleCorrection::setInput(vtkSmartPointer<vtkPolyData> vpd_centerline, cons
         reportError("ERROR: Could not read velocity data \n");
     }
 
-    setInput(vpd_centerline,  new vector<MetaImage<inData_t>>(),  Vnyq, cutoff, nConvolutions, uncertainty_limit, minArrowDist);
+    setInput(vpd_centerline, Vnyq, cutoff, nConvolutions, uncertainty_limit, minArrowDist);
 }
 
 
-void AngleCorrection::setInput(const char* centerline,const char* image_prefix, double Vnyq, double cutoff, int nConvolutions, double uncertainty_limit, double minArrowDist)
+template<typename T>
+void AngleCorrectionT<T>::setInput(const char* centerline,const char* image_prefix, double Vnyq, double cutoff, int nConvolutions, double uncertainty_limit, double minArrowDist)
 {
 
     cerr << "Input params: " << centerline<< "      "   << image_prefix  << "      "  <<  Vnyq << "            " << nConvolutions << "         " << uncertainty_limit<< "         " << minArrowDist <<endl;
@@ -167,10 +300,77 @@ void AngleCorrection::setInput(const char* centerline,const char* image_prefix,
 
 
 
-bool AngleCorrection::calculate()
+/**
+* Run the algorithm, blocking until it is done.
+* Waits for a calculation started by calculateAsync() first.
+* @param callback - if given, called with the progress as it changes, see CalculationProgress::setCallback()
+* @return true on success, false on invalid input or if cancelled
+*/
+template<typename T>
+bool AngleCorrectionT<T>::calculate(const CalculationProgress::Callback& callback)
+{
+    if(mCalculation.valid()) mCalculation.wait();
+    syncCenterline();
+    mProgress->setCallback(callback);
+    bool res = false;
+    try {
+        res = runCalculation();
+    } catch (...) {
+        mProgress->setCallback(CalculationProgress::Callback());
+        throw;
+    }
+    mProgress->setCallback(CalculationProgress::Callback());
+    return res;
+}
+
+
+/**
+* Run the algorithm in a separate thread.
+* Progress can be followed through getProgress(), and the run can be stopped with cancel().
+* The arrays of the centerline must not be changed in place until the calculation is done, see setInput().
+* While a calculation is running, it is not started again.
+* @return handle to the result of calculate(), or of the calculation already running
+*/
+template<typename T>
+std::shared_future<bool> AngleCorrectionT<T>::calculateAsync()
+{
+    if(isCalculating()) return mCalculation;
+    syncCenterline();
+    mCalculation = std::async(std::launch::async, [this](){ return runCalculation(); }).share();
+    return mCalculation;
+}
+
+
+/**
+* Ask a running calculation, or the next one if none is running, to stop.
+* The calculation returns false, and the next calculate() continues from the stages that were completed.
+* setInput() withdraws the request.
+*/
+template<typename T>
+void AngleCorrectionT<T>::cancel()
+{
+    mProgress->cancel();
+}
+
+
+/**
+* @return true while a calculation started by calculateAsync() is running
+*/
+template<typename T>
+bool AngleCorrectionT<T>::isCalculating() const
+{
+    return mCalculation.valid() && mCalculation.wait_for(std::chrono::seconds(0)) != std::future_status::ready;
+}
+
+
+template<typename T>
+bool AngleCorrectionT<T>::runCalculation()
 {
     cerr << "params: " << mnConvolutions<< "      "   << mCutoff  << "      "  <<  mUncertainty_limit << "            " << mMinArrowDist << "         " << mVnyq <<endl;
 
+    // Counted from zero, but a cancel request made while the run was set up still applies
+    mProgress->restart();
+    mCancelled = false;
     if(!mValidInput)
     {
         cerr << "Invalid input " << endl;
@@ -179,47 +379,67 @@ bool AngleCorrection::calculate()
     }
     mValidInput=false;
 
-    if(mVelDataPtr->size() == 0)
-    {
-        cerr << "Loading data " << endl;
-        mVelDataPtr->clear();
-        mVelDataPtr = MetaImage<inData_t>::readImages(mVelImagePrefix);
-    }
-
+    // Step 1 is everything up to the velocities, step 2 the output generation
     mNumOfStepsRan=0;
-    if(mUpdate1)
+    mBloodVesselsSmoothed = 0;
+    mBloodVesselsIntersected = 0;
+    bool step1 = false;
+    std::string stages;
+    for(size_t i = 0; i < mPipeline.size(); i++)
     {
-        mNumOfStepsRan++;
-        cerr << "started step 1 of 2 "<< endl;
-        angle_correction_impl(mClData, mVelDataPtr, mVnyq, mCutoff, mnConvolutions);
+        if(!mPipeline.isDirty(i)) continue;
+        if(i != (size_t)mOutputNode) step1 = true;
+        stages += (stages.empty() ? "" : ", ") + mPipeline.getName(i);
     }
-
-    if(mUpdate1 || mUpdate2)
-    {
-        mNumOfStepsRan++;
-        cerr << "started step 2 of 2" << endl;
-        mOutput= computeVtkPolyData(mClSplinesPtr, mUncertainty_limit, mMinArrowDist);
+    if(step1) mNumOfStepsRan++;
+    if(mPipeline.isDirty(mOutputNode)) mNumOfStepsRan++;
+    if(!stages.empty()) cerr << "Running " << stages << endl;
+
+    try {
+        mPipeline.execute();
+    } catch (CalculationCancelled&) {
+        restartInterruptedStages();
+        cerr << "Calculation cancelled " << endl;
+        mCancelled = true;
+        mValidInput = true;
+        mProgress->reset();
+        return false;
+    } catch (...) {
+        restartInterruptedStages();
+        throw;
     }
-
-    mUpdate1=false;
-    mUpdate2=false;
     return true;
 }
 
-vtkSmartPointer<vtkPolyData>  AngleCorrection::getOutput()
+
+/**
+* Prepare the pipeline for the next run after it was interrupted.
+* Smoothing works in place, so if it was interrupted it must start over from its input
+*/
+template<typename T>
+void AngleCorrectionT<T>::restartInterruptedStages()
+{
+    if(mPipeline.isDirty(mSmoothingNode)) mPipeline.invalidate(mSplineBuildNode);
+    mOutput = NULL;
+}
+
+template<typename T>
+vtkSmartPointer<vtkPolyData>  AngleCorrectionT<T>::getOutput()
 {
     return mOutput;
 }
 
 
-vectorSpline3dDouble AngleCorrection::getClSpline()
+template<typename T>
+typename AngleCorrectionT<T>::SplineVector AngleCorrectionT<T>::getClSpline()
 {
     return *mClSplinesPtr;
 }
 
 
 
-void AngleCorrection::writeDirectionToVtkFile(const char* filename)
+template<typename T>
+void AngleCorrectionT<T>::writeDirectionToVtkFile(const char* filename)
 {
 
     vtkSmartPointer<vtkPolyData> polydata = getOutput();
@@ -246,63 +466,274 @@ void AngleCorrection::writeDirectionToVtkFile(const char* filename)
     }
 }
 
-void AngleCorrection::angle_correction_impl(vtkSmartPointer<vtkPolyData> vpd_centerline, vector<MetaImage<inData_t> >* images , double Vnyq, double cutoff,  int nConvolutions)
+template<typename T>
+void AngleCorrectionT<T>::loadFrames()
 {
-    bool verbose = false;
+    cerr << "Loading data " << endl;
+    // Frames already loaded by another instance are shared
+    FrameStore::Ptr frames = FrameStore::lookup(mVelImagePrefix);
+    if(frames)
+    {
+        mProgress->add(mProgress->framesLoaded, frames->size());
+    }
+    else
+    {
+        // Free our previous frames before reading the new ones, unless someone else uses them
+        mFrames.reset();
+        frames = FrameStore::load(mVelImagePrefix, mProgress.get());
+    }
+    mFrames = frames;
+}
 
-    mClSplinesPtr->clear();
-    mClSplinesPtr = Spline3D<double>::build(vpd_centerline);
 
-    for(auto &spline: *mClSplinesPtr)
+template<typename T>
+void AngleCorrectionT<T>::parseCenterline()
+{
+    mParsedSplinesPtr->clear();
+    delete mParsedSplinesPtr;
+    mParsedSplinesPtr = Spline3D<T>::build(mClData);
+    // The arrays are shared with the input, see updateCenterline()
+    if(mClData->GetMTime() != mClSnapshotMTime)
     {
-        mBloodVessels++;
-        // Smooth the splines
-        for(int j = 0; j < nConvolutions; j++)
-        {
-            spline.applyConvolution({0.25, 0.50, 0.25 });
-        }
+        reportError("ERROR: The center line was changed in place during the calculation ");
+    }
+    mParsedHashes.resize(mParsedSplinesPtr->size());
+    for(size_t k = 0; k < mParsedSplinesPtr->size(); k++)
+    {
+        mParsedHashes[k] = (*mParsedSplinesPtr)[k].hashPoints();
+    }
+}
 
-        // Compute control points for splines
-        spline.compute();
 
-        // Find all the intersections
-        spline.findAllIntersections(*images);
-        spline.getIntersections().setVelocityEstimationCutoff(cutoff,1.0);
-        mIntersections += spline.getIntersections().size();
+template<typename T>
+void AngleCorrectionT<T>::buildSplines()
+{
+    // Keep the finished splines of the previous run, smoothSplines() takes over the unchanged ones
+    mPreviousSplines.clear();
+    mPreviousHashes.clear();
+    if(mSmoothedWith >= 0 && mBranchHashes.size() == mClSplinesPtr->size())
+    {
+        mPreviousSplines.swap(*mClSplinesPtr);
+        mPreviousHashes.swap(mBranchHashes);
+        mPreviousSmoothedWith = mSmoothedWith;
+        mPreviousFrames = mGrownFrames;
+        mPreviousAllCrossings = mGrownAllCrossings;
+    }
+    mSmoothedWith = -1;
+    mGrownFrames.reset();
+
+    *mClSplinesPtr = *mParsedSplinesPtr;
+    mBranchHashes = mParsedHashes;
+    mBloodVessels += mClSplinesPtr->size();
+    mProgress->add(mProgress->splinesTotal, mClSplinesPtr->size());
+}
 
-        // Now that we know the intersection points,
-        // we can go through all the image planes and do the region growing.
-        for_each(spline.getIntersections().begin(), spline.getIntersections().end(),[](Intersection<double> &it){it.regionGrow();});
 
-        // We may now do the direction vector estimation
-        // Using the default parameters set in IntersectionSet constructor
-        spline.getIntersections().estimateDirection();
+template<typename T>
+void AngleCorrectionT<T>::smoothSplines()
+{
+    const int nConvolutions = mnConvolutions;
+    SplineVector& splines = *mClSplinesPtr;
+    mBranchReused.assign(splines.size(), 0);
+    mReusedFrames.reset();
+    mReusedFromCache = false;
+
+    // Smoothed before, take the splines with their control points and intersections from the cache
+    const typename SplineCache<T>::Entry* cached = mSplineCache.lookup(mClHash, nConvolutions);
+    if(cached)
+    {
+#ifdef DEBUG_SPLINE_CACHE
+        cerr << "Spline cache hit (" << mSplineCache.getHits() << " hits, " << mSplineCache.getMisses() << " misses)" << endl;
+#endif
+        splines = cached->splines;
+        mBranchReused.assign(splines.size(), 1);
+        mReusedFrames = cached->frames;
+        mReusedAllCrossings = cached->allCrossings;
+        mReusedFromCache = true;
+        mPreviousSplines.clear();
+        return;
+    }
+#ifdef DEBUG_SPLINE_CACHE
+    cerr << "Spline cache miss (" << mSplineCache.getHits() << " hits, " << mSplineCache.getMisses() << " misses)" << endl;
+#endif
 
-        // Do aliasing correction
-        if (Vnyq > 0){
-            spline.getIntersections().correctAliasing(Vnyq);
+    // Otherwise take the branches that did not change since the previous run from it
+    if(!mPreviousSplines.empty() && mPreviousSmoothedWith == nConvolutions)
+    {
+        std::unordered_map<uint64_t, size_t> previous;
+        for(size_t j = 0; j < mPreviousHashes.size(); j++)
+        {
+            previous.insert(std::make_pair(mPreviousHashes[j], j));
+        }
+        for(size_t k = 0; k < splines.size(); k++)
+        {
+            auto it = previous.find(mBranchHashes[k]);
+            if(it == previous.end()) continue;
+            splines[k] = std::move(mPreviousSplines[it->second]);
+            previous.erase(it);
+            mBranchReused[k] = 1;
         }
+        mReusedFrames = mPreviousFrames;
+        mReusedAllCrossings = mPreviousAllCrossings;
+#ifdef DEBUG_SPLINE_CACHE
+        cerr << "Reusing " << std::count(mBranchReused.begin(), mBranchReused.end(), 1)
+             << " of " << splines.size() << " blood vessels from the previous run" << endl;
+#endif
+    }
+    mPreviousSplines.clear();
+    mBloodVesselsSmoothed = splines.size() - std::count(mBranchReused.begin(), mBranchReused.end(), 1);
+
+    const CalculationProgress& progress = *mProgress;
+    TaskScheduler::instance().parallelFor(0, splines.size(), [&](size_t k)
+    {
+        if(mBranchReused[k]) return;
+        progress.checkCancelled();
+        splines[k].smooth(nConvolutions);
+    });
+}
 
-        // Least squares velocity estimates
-        spline.getIntersections().estimateVelocityLS();
 
-        // Output direction and LS velocity
-        if (verbose)
+template<typename T>
+void AngleCorrectionT<T>::fitSplines()
+{
+    // Compute control points for splines
+    SplineVector& splines = *mClSplinesPtr;
+    CalculationProgress& progress = *mProgress;
+    TaskScheduler::instance().parallelFor(0, splines.size(), [&](size_t k)
+    {
+        if(!mBranchReused[k])
         {
-            cerr << "Spline " << mBloodVessels << " gave direction "
-                 << spline.getIntersections().getEstimatedDirection()
-                 << " LS velocity " << spline.getIntersections().getEstimatedVelocity() << endl;
+            progress.checkCancelled();
+            splines[k].compute();
         }
+        progress.add(progress.splinesFitted);
+    });
+    mSmoothedWith = mnConvolutions;
+}
+
+
+template<typename T>
+void AngleCorrectionT<T>::findIntersections()
+{
+    // The splines differ a lot in length and in number of intersections,
+    // so every spline is a separate task and the scheduler balances the load
+    SplineVector& splines = *mClSplinesPtr;
+    const vector<MetaImage<inData_t> >& images = mFrames->getFrames();
+    const PlaneBatch<T>& planes = mFrames->getPlanes<T>();
+    const CalculationProgress& progress = *mProgress;
+    const bool reuse = reuseIntersections();
+    mGrownFrames.reset();
+    mBloodVesselsIntersected = reuse ? splines.size() - std::count(mBranchReused.begin(), mBranchReused.end(), 1) : splines.size();
+    TaskScheduler::instance().parallelFor(0, splines.size(), [&](size_t k)
+    {
+        if(reuse && mBranchReused[k]) return;
+        progress.checkCancelled();
+        splines[k].setAllCrossings(mAllCrossings);
+        splines[k].findAllIntersections(images, planes);
+    });
+
+    for(auto &spline: splines)
+    {
+        mIntersections += spline.getIntersections().size();
+        mProgress->add(mProgress->intersectionsTotal, spline.getIntersections().size());
     }
-    if (verbose)
+}
+
+
+/**
+* @return true if the splines taken from an earlier run, see smoothSplines(),
+* have intersections found in the current frames with the current crossing mode
+*/
+template<typename T>
+bool AngleCorrectionT<T>::reuseIntersections() const
+{
+    return mFrames && mReusedFrames.lock() == mFrames && mReusedAllCrossings == mAllCrossings;
+}
+
+
+template<typename T>
+void AngleCorrectionT<T>::growRegions()
+{
+    // Now that we know the intersection points,
+    // we can go through all the image planes and do the region growing.
+    TaskScheduler& scheduler = TaskScheduler::instance();
+    CalculationProgress& progress = *mProgress;
+    SplineVector& splines = *mClSplinesPtr;
+    const bool reuse = reuseIntersections();
+    scheduler.parallelFor(0, splines.size(), [&](size_t k)
+    {
+        IntersectionSet<T> &intersections = splines[k].getIntersections();
+        if(reuse && mBranchReused[k])
+        {
+            progress.add(progress.intersectionsGrown, intersections.size());
+            return;
+        }
+        // Taken once, as the set marks its statistics out of date on every mutable access
+        Intersection<T>* grown = intersections.data();
+        scheduler.parallelFor(0, intersections.size(), [&](size_t i)
+        {
+            progress.checkCancelled();
+            grown[i].regionGrow();
+            progress.add(progress.intersectionsGrown);
+        });
+        intersections.updateStatistics();
+    });
+    mBranchReused.assign(splines.size(), 0);
+    mReusedFrames.reset();
+    mGrownFrames = mFrames;
+    mGrownAllCrossings = mAllCrossings;
+    // Everything taken from the cache entry for these splines is already stored there
+    if(!(reuse && mReusedFromCache))
     {
-        cerr << "Found " << mIntersections << " intersections in " << mBloodVessels << " splines.\n";
+        mSplineCache.store(mClHash, mnConvolutions, splines, mFrames, mAllCrossings);
     }
+    mReusedFromCache = false;
 }
 
 
+template<typename T>
+void AngleCorrectionT<T>::estimateDirections()
+{
+    // Using the default parameters set in IntersectionSet constructor
+    SplineVector& splines = *mClSplinesPtr;
+    TaskScheduler::instance().parallelFor(0, splines.size(), [&](size_t k)
+    {
+        splines[k].getIntersections().estimateDirection();
+    });
+}
 
-vtkSmartPointer<vtkPolyData> AngleCorrection::computeVtkPolyData( vectorSpline3dDoublePtr splines, double uncertainty_limit, double minArrowDist)
+
+template<typename T>
+void AngleCorrectionT<T>::correctAliasing()
+{
+    // The correction always starts from the uncorrected averages,
+    // so without aliasing correction the previous correction is undone
+    const double Vnyq = mVnyq > 0 ? mVnyq : 0.0;
+    SplineVector& splines = *mClSplinesPtr;
+    TaskScheduler::instance().parallelFor(0, splines.size(), [&](size_t k)
+    {
+        splines[k].getIntersections().correctAliasing(Vnyq);
+    });
+}
+
+
+template<typename T>
+void AngleCorrectionT<T>::estimateVelocities()
+{
+    // Least squares velocity estimates
+    const double cutoff = mCutoff;
+    SplineVector& splines = *mClSplinesPtr;
+    TaskScheduler::instance().parallelFor(0, splines.size(), [&](size_t k)
+    {
+        splines[k].getIntersections().setVelocityEstimationCutoff(cutoff,1.0);
+        splines[k].getIntersections().estimateVelocityLS();
+    });
+}
+
+
+
+template<typename T>
+vtkSmartPointer<vtkPolyData> AngleCorrectionT<T>::computeVtkPolyData( SplineVectorPtr splines, double uncertainty_limit, double minArrowDist)
 {
     vtkSmartPointer<vtkPoints> pointarray = vtkSmartPointer<vtkPoints>::New();
     vtkSmartPointer<vtkDoubleArray> flowdirection = vtkSmartPointer<vtkDoubleArray>::New();
@@ -314,12 +745,17 @@ vtkSmartPointer<vtkPolyData> AngleCorrection::computeVtkPolyData( vectorSpline3d
     velocitydata->SetName("Vessel velocity");
 
     double p[3];
-    double p_prev[3];
+    T p_prev[3];
     double p_temp[3];
     double flow_vector[3];
     double flow_vector_n[3];
     double abs_dir;
     double abs_vessel_vel;
+    std::vector<T> ts;
+    std::vector<T> positions[3];
+    std::vector<T> derivatives[3];
+    T* positionPtrs[3];
+    T* derivativePtrs[3];
     mBloodVesselsRemoved = 0;
     for(auto &spline: *splines)
     {
@@ -338,9 +774,26 @@ vtkSmartPointer<vtkPolyData> AngleCorrection::computeVtkPolyData( vectorSpline3d
             continue;
         }
 
-        spline.evaluateSingle(0,p_prev);
+        // Evaluate all the sample positions of the spline at once
+        ts.clear();
         for(double t = 0; t < (spline.length()-1); t+=0.3){
-            spline.evaluateSingle(t,p);
+            ts.push_back(t);
+        }
+        for(int i = 0; i < 3; i++)
+        {
+            positions[i].resize(ts.size());
+            derivatives[i].resize(ts.size());
+            positionPtrs[i] = positions[i].data();
+            derivativePtrs[i] = derivatives[i].data();
+        }
+        spline.evaluateMany(ts.data(), ts.size(), positionPtrs);
+        spline.derivativeMany(ts.data(), ts.size(), derivativePtrs);
+
+        spline.evaluateSingle(0,p_prev);
+        for(size_t k = 0; k < ts.size(); k++){
+            p[0]=positions[0][k];
+            p[1]=positions[1][k];
+            p[2]=positions[2][k];
             if(std::isnan(p[0]) || std::isnan(p[1]) || std::isnan(p[2])  ){
                 continue;
             }
@@ -355,11 +808,9 @@ vtkSmartPointer<vtkPolyData> AngleCorrection::computeVtkPolyData( vectorSpline3d
             p_prev[1]=p[1];
             p_prev[2]=p[2];
 
-            spline.derivativeSingle(t,flow_vector);
-
-            flow_vector[0]=flow_direction*flow_vector[0];
-            flow_vector[1]=flow_direction*flow_vector[1];
-            flow_vector[2]=flow_direction*flow_vector[2];
+            flow_vector[0]=flow_direction*derivatives[0][k];
+            flow_vector[1]=flow_direction*derivatives[1][k];
+            flow_vector[2]=flow_direction*derivatives[2][k];
 
             normalize3d(flow_vector_n, flow_vector);
             if(std::isnan(flow_vector_n[0]) || std::isnan(flow_vector_n[1]) || std::isnan(flow_vector_n[2]) ){
@@ -388,28 +839,48 @@ vtkSmartPointer<vtkPolyData> AngleCorrection::computeVtkPolyData( vectorSpline3d
 
 
 
-bool AngleCorrection::EqualVtkPolyData( vtkSmartPointer<vtkPolyData> leftHandSide, vtkSmartPointer<vtkPolyData> rightHandSide)
+/**
+* Take a new centerline, without copying its points and lines.
+* The centerline is held by reference. Its modification time tells if it may have
+* changed since it was last seen, and then its content hash tells if it did.
+* The calculation parses a snapshot, a shallow copy holding references to the point and
+* line arrays of the centerline as they are now. Replacing them in the centerline leaves
+* the snapshot as it was, changing them in place shows in its modification time.
+* Called on the calling thread, never while a calculation runs.
+* @param centerline - the new centerline
+* @return true if its content differs from the previous centerline
+*/
+template<typename T>
+bool AngleCorrectionT<T>::updateCenterline(vtkSmartPointer<vtkPolyData> centerline)
+{
+    const uint64_t mtime = centerline->GetMTime();
+    if(mClInput && centerline.GetPointer() == mClInput.GetPointer() && mtime == mClMTime) return false;
+
+    vtkSmartPointer<vtkPolyData> snapshot = vtkSmartPointer<vtkPolyData>::New();
+    snapshot->ShallowCopy(centerline);
+    const uint64_t hash = hashCenterline(snapshot);
+    const bool changed = !mClData || hash != mClHash;
+    mClInput = centerline;
+    mClData = snapshot;
+    mClMTime = mtime;
+    mClSnapshotMTime = snapshot->GetMTime();
+    mClHash = hash;
+    return changed;
+}
+
+
+/**
+* Take a new snapshot of the centerline if it was changed in place since setInput()
+*/
+template<typename T>
+void AngleCorrectionT<T>::syncCenterline()
 {
-    if( leftHandSide->GetNumberOfCells()!=rightHandSide->GetNumberOfCells()) return false;
-    if( leftHandSide->GetNumberOfVerts()!=rightHandSide->GetNumberOfVerts()) return false;
-    if( leftHandSide->GetNumberOfLines()!=rightHandSide->GetNumberOfLines()) return false;
-    if( leftHandSide->GetNumberOfPolys()!=rightHandSide->GetNumberOfPolys()) return false;
-    if(leftHandSide->GetNumberOfStrips()!=rightHandSide->GetNumberOfStrips())return false;
-    unsigned int numberOfPointsRight = rightHandSide->GetNumberOfPoints();
-    unsigned int numberOfPointsLeft = leftHandSide->GetNumberOfPoints();
-    if(numberOfPointsLeft!=numberOfPointsRight) return false;
-
-    double pointOne[3];
-    double pointTwo[3];
-    for( unsigned int i( 0 ); i < numberOfPointsRight; i++ )
+    if(mValidInput && mClInput && updateCenterline(mClInput))
     {
-        rightHandSide->GetPoint(i, pointOne);
-        leftHandSide->GetPoint(i, pointTwo);
-        double x = pointOne[0] - pointTwo[0];
-        double y = pointOne[1] - pointTwo[1];
-        double z = pointOne[2] - pointTwo[2];
-        double distance = x*x + y*y + z*z;
-        if( distance > 0.001 ) return false;
+        mPipeline.invalidate(mCenterlineParseNode);
     }
-     return true;
 }
+
+
+template class AngleCorrectionT<double>;
+template class AngleCorrectionT<float>;
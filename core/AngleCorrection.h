@@ -1,7 +1,13 @@
 #ifndef ANGLE_CORRECTION_IMPL_H
 #define ANGLE_CORRECTION_IMPL_H
 
+#include <future>
+#include <memory>
 #include "spline3d.hpp"
+#include "calculation_progress.hpp"
+#include "frame_store.hpp"
+#include "spline_cache.hpp"
+#include "task_graph.hpp"
 
 
 typedef vector<Spline3D<double> > vectorSpline3dDouble;
@@ -9,47 +15,142 @@ typedef vectorSpline3dDouble* vectorSpline3dDoublePtr;
 
 
 
-class AngleCorrection
+/**
+ * The angle correction algorithm, computing in precision T.
+ * T is double or float. The float version keeps root finding and sums in double,
+ * see AccumulatorType, and is within a fraction of a percent of the double version.
+ */
+template<typename T>
+class AngleCorrectionT
 {
 public:
-    AngleCorrection();
-    ~AngleCorrection();
+    typedef vector<Spline3D<T> > SplineVector;
+    typedef SplineVector* SplineVectorPtr;
+
+    AngleCorrectionT();
+    AngleCorrectionT(AngleCorrectionT&& other);
+    AngleCorrectionT& operator=(AngleCorrectionT&& other);
+    ~AngleCorrectionT();
     void setInput(vtkSmartPointer<vtkPolyData> vpd_centerline, const  char* image_prefix , double Vnyq, double cutoff,  int nConvolutions, double uncertainty_limit=0.0, double minArrowDist= 1.0);
     void setInput(const char* centerline,const char* image_prefix, double Vnyq, double cutoff,int nConvolutions, double uncertainty_limit=0.0, double minArrowDist= 1.0);
-    bool calculate();
+    bool calculate(const CalculationProgress::Callback& callback = CalculationProgress::Callback());
+    std::shared_future<bool> calculateAsync();
+    void cancel();
+    bool isCalculating() const;
+    void setReportAllCrossings(bool allCrossings);
+    bool getReportAllCrossings() const {return mAllCrossings;}
+    bool wasCancelled() const {return mCancelled;}
+    const CalculationProgress& getProgress() const {return *mProgress;}
+    FrameStore::Ptr getFrameStore() const {return mFrames;}
     vtkSmartPointer<vtkPolyData> getOutput();
-    vectorSpline3dDouble getClSpline();
+    SplineVector getClSpline();
     void writeDirectionToVtkFile(const char* filename);
     int getIntersections(){return mIntersections;}
     int getBloodVessels(){return mBloodVessels-mBloodVesselsRemoved;}
+    int getBloodVesselsSmoothed() const {return mBloodVesselsSmoothed;}
+    int getBloodVesselsIntersected() const {return mBloodVesselsIntersected;}
     int getNumOfStepsRan(){return mNumOfStepsRan;}
+    void setSplineCacheCapacity(size_t capacity);
+    size_t getSplineCacheHits() const {return mSplineCache.getHits();}
+    size_t getSplineCacheMisses() const {return mSplineCache.getMisses();}
 
 private:
-    void setInput(vtkSmartPointer<vtkPolyData> vpd_centerline, vector<MetaImage<inData_t> >* velData, double Vnyq, double cutoff, int nConvolutions, double uncertainty_limit=0.0, double minArrowDist= 1.0);
-    void angle_correction_impl(vtkSmartPointer<vtkPolyData> vpd_centerline, vector<MetaImage<inData_t> >* images , double Vnyq, double cutoff,  int nConvolutions);
-    vtkSmartPointer<vtkPolyData> computeVtkPolyData( vectorSpline3dDoublePtr splines, double uncertainty_limit, double minArrowDist);
-    bool EqualVtkPolyData( vtkSmartPointer<vtkPolyData> leftHandSide, vtkSmartPointer<vtkPolyData> rightHandSide);
+    void setInput(vtkSmartPointer<vtkPolyData> vpd_centerline, double Vnyq, double cutoff, int nConvolutions, double uncertainty_limit=0.0, double minArrowDist= 1.0);
+    bool runCalculation();
+    void restartInterruptedStages();
+    void buildPipeline();
+    void loadFrames();
+    void parseCenterline();
+    void buildSplines();
+    void smoothSplines();
+    void fitSplines();
+    void findIntersections();
+    bool reuseIntersections() const;
+    void growRegions();
+    void estimateDirections();
+    void correctAliasing();
+    void estimateVelocities();
+    vtkSmartPointer<vtkPolyData> computeVtkPolyData( SplineVectorPtr splines, double uncertainty_limit, double minArrowDist);
+    bool updateCenterline(vtkSmartPointer<vtkPolyData> centerline);
+    void syncCenterline();
 
+    // The centerline is held by reference, and parsed from a snapshot, see updateCenterline()
+    vtkSmartPointer<vtkPolyData> mClInput;
     vtkSmartPointer<vtkPolyData> mClData;
-    vector<MetaImage<inData_t> > * mVelDataPtr;
+    uint64_t mClMTime;
+    uint64_t mClSnapshotMTime;
+    uint64_t mClHash;
+    FrameStore::Ptr mFrames;
     std::string mVelImagePrefix;
     double mVnyq;
     double mCutoff;
     int mnConvolutions;
     double mUncertainty_limit;
     double mMinArrowDist;
+    bool mAllCrossings;
 
     vtkSmartPointer<vtkPolyData> mOutput;
 
-    vectorSpline3dDoublePtr mClSplinesPtr;
-    bool mUpdate1;
-    bool mUpdate2;
+    SplineVectorPtr mParsedSplinesPtr;
+    SplineVectorPtr mClSplinesPtr;
     bool mValidInput;
 
+    // Results of earlier runs, see smoothSplines()
+    SplineCache<T> mSplineCache;
+    // Hash of the points of each parsed spline, see Spline3D::hashPoints()
+    vector<uint64_t> mParsedHashes;
+    // The same for the splines in mClSplinesPtr, and what has been computed for them
+    vector<uint64_t> mBranchHashes;
+    int mSmoothedWith;
+    std::weak_ptr<const FrameStore> mGrownFrames;
+    bool mGrownAllCrossings;
+    // The splines of the previous run, until the unchanged ones are taken over
+    SplineVector mPreviousSplines;
+    vector<uint64_t> mPreviousHashes;
+    int mPreviousSmoothedWith;
+    std::weak_ptr<const FrameStore> mPreviousFrames;
+    bool mPreviousAllCrossings;
+    // The splines taken from an earlier run, and the frames their intersections belong to
+    vector<char> mBranchReused;
+    std::weak_ptr<const FrameStore> mReusedFrames;
+    bool mReusedAllCrossings;
+    // All splines are from the cache entry of this centerline and smoothing level
+    bool mReusedFromCache;
+
+    std::shared_ptr<CalculationProgress> mProgress;
+    std::shared_future<bool> mCalculation;
+    bool mCancelled;
+
+    // The pipeline stages, see buildPipeline()
+    TaskGraph mPipeline;
+    TaskGraph::NodeId mFrameLoadNode;
+    TaskGraph::NodeId mCenterlineParseNode;
+    TaskGraph::NodeId mSplineBuildNode;
+    TaskGraph::NodeId mSmoothingNode;
+    TaskGraph::NodeId mFittingNode;
+    TaskGraph::NodeId mIntersectionNode;
+    TaskGraph::NodeId mRegionGrowingNode;
+    TaskGraph::NodeId mDirectionNode;
+    TaskGraph::NodeId mAliasingNode;
+    TaskGraph::NodeId mVelocityNode;
+    TaskGraph::NodeId mOutputNode;
+
     int mIntersections;
     int mBloodVessels;
+    // Blood vessels smoothed and fitted, and intersected and region grown, by the last run,
+    // the others were taken from an earlier run, see smoothSplines()
+    int mBloodVesselsSmoothed;
+    int mBloodVesselsIntersected;
     int mNumOfStepsRan;
     int mBloodVesselsRemoved;
 
 };
+
+typedef AngleCorrectionT<double> AngleCorrection;
+typedef AngleCorrectionT<float> AngleCorrectionFloat;
+
+// Instantiated in AngleCorrection.cpp
+extern template class AngleCorrectionT<double>;
+extern template class AngleCorrectionT<float>;
+
 #endif /* ANGLE_CORRECTION_IMPL_H */
@@ -9,11 +9,22 @@
 #include <vector>
 #include <vtkSmartPointer.h>
 #include "AngleCorrection.h"
+#include "centerline_hash.hpp"
+#include "reduction.hpp"
+#include "simd_dispatch.hpp"
+#include "task_graph.hpp"
+#include "task_scheduler.hpp"
 #include <vtkPolyDataWriter.h>
 #include <vtkPolyDataReader.h>
 #include <vtkPolyData.h>
 #include <vtkPointData.h>
+#include <vtkPoints.h>
+#include <vtkCellArray.h>
+#include <vtkIdList.h>
+#include <algorithm>
 #include <cstdio>
+#include <cstring>
+#include <memory>
 #include <time.h>
 
 #include "catch.hpp"
@@ -1003,3 +1014,1497 @@ TEST_CASE("AngleCorrection: Test error handler", "[angle_correction]")
     REQUIRE(errorObserver->GetWarningMessage().length()==0);
 
 }
+
+
+TEST_CASE("AngleCorrection: Test work stealing scheduler", "[angle_correction][task_scheduler]")
+{
+    TaskScheduler scheduler(4);
+    REQUIRE(scheduler.getNumberOfThreads()==4);
+
+    // Unbalanced work: index i costs i iterations
+    const size_t n = 2000;
+    vector<double> result(n, 0.0);
+    REQUIRE_NOTHROW(scheduler.parallelFor(0, n, [&](size_t i)
+    {
+        double sum = 0.0;
+        for(size_t k = 0; k < i; k++) sum += 1.0;
+        result[i] = sum;
+    }));
+    for(size_t i = 0; i < n; i++)
+    {
+        REQUIRE(result[i] == (double)i);
+    }
+
+    // Nested loops must not dead lock
+    vector<int> counts(64, 0);
+    REQUIRE_NOTHROW(scheduler.parallelFor(0, counts.size(), [&](size_t i)
+    {
+        vector<int> inner(100, 0);
+        scheduler.parallelFor(0, inner.size(), [&](size_t j){ inner[j] = 1; });
+        for(int v: inner) counts[i] += v;
+    }));
+    for(int v: counts)
+    {
+        REQUIRE(v == 100);
+    }
+
+    // Exceptions are passed on to the waiting thread
+    REQUIRE_THROWS(scheduler.parallelFor(0, 100, [&](size_t i)
+    {
+        if(i == 57) reportError("ERROR: test");
+    }));
+
+    TaskScheduler serial(1);
+    REQUIRE(serial.getNumberOfThreads()==1);
+    int sum = 0;
+    serial.parallelFor(0, 10, [&](size_t i){ sum += i; });
+    REQUIRE(sum == 45);
+}
+
+
+TEST_CASE("AngleCorrection: Test task graph", "[angle_correction][task_graph]")
+{
+    TaskScheduler scheduler(4);
+    TaskGraph graph;
+    vector<int> runs(4, 0);
+    bool fail = false;
+
+    // a -> c, b -> c -> d
+    TaskGraph::NodeId a = graph.addNode("a", [&](){ runs[0]++; });
+    TaskGraph::NodeId b = graph.addNode("b", [&](){ runs[1]++; if(fail) reportError("ERROR: test"); });
+    TaskGraph::NodeId c = graph.addNode("c", [&](){ runs[2]++; }, {a, b});
+    TaskGraph::NodeId d = graph.addNode("d", [&](){ runs[3]++; }, {c});
+
+    REQUIRE(graph.execute(scheduler).size()==4);
+    REQUIRE(runs==vector<int>({1, 1, 1, 1}));
+    REQUIRE(!graph.isDirty(d));
+
+    // Nothing changed, nothing to do
+    REQUIRE(graph.execute(scheduler).size()==0);
+
+    // Only the invalidated node and its dependents run again
+    graph.invalidate(c);
+    REQUIRE(graph.execute(scheduler).size()==2);
+    REQUIRE(runs==vector<int>({1, 1, 2, 2}));
+
+    // A failing node stays dirty, and so does everything after it
+    fail = true;
+    graph.invalidate(a);
+    graph.invalidate(b);
+    REQUIRE_THROWS(graph.execute(scheduler));
+    REQUIRE(!graph.isDirty(a));
+    REQUIRE(graph.isDirty(b));
+    REQUIRE(graph.isDirty(d));
+    REQUIRE(runs[3]==2);
+
+    fail = false;
+    REQUIRE(graph.execute(scheduler).size()==3);
+    REQUIRE(runs==vector<int>({2, 3, 3, 3}));
+}
+
+
+TEST_CASE("AngleCorrection: Test deterministic reduction", "[angle_correction][reduction]")
+{
+    // Terms of very different magnitude, where the summation order matters
+    const size_t n = 10007;
+    vector<double> terms(n);
+    for(size_t i = 0; i < n; i++)
+    {
+        terms[i] = (i % 3 == 0 ? 1e8 : 1e-3) * (i % 2 == 0 ? 1.0 : -0.7) + i*1e-7;
+    }
+    auto term = [&](size_t i){ return terms[i]; };
+    auto add = [](double a, double b){ return a + b; };
+
+    TaskScheduler serial(1);
+    TaskScheduler parallel(4);
+    TaskScheduler parallel3(3);
+    double sum1 = deterministicReduce(n, 0.0, term, add, serial);
+    double sum4 = deterministicReduce(n, 0.0, term, add, parallel);
+    double sum3 = deterministicReduce(n, 0.0, term, add, parallel3);
+    for(int run = 0; run < 10; run++)
+    {
+        REQUIRE(deterministicReduce(n, 0.0, term, add, parallel) == sum1);
+    }
+    REQUIRE(sum4 == sum1);
+    REQUIRE(sum3 == sum1);
+    REQUIRE(sum1 == Approx(std::accumulate(terms.begin(), terms.end(), 0.0)));
+
+    std::pair<double,double> sums = deterministicReduce(n, std::make_pair(0.0, 0.0),
+        [&](size_t i){ return std::make_pair(1.0, (double)i); }, pairSum<double>, parallel);
+    REQUIRE(sums.first == (double)n);
+    REQUIRE(sums.second == (double)(n*(n-1)/2));
+
+    REQUIRE(deterministicSum<double>(0, term) == 0.0);
+}
+
+
+TEST_CASE("AngleCorrection: Test concurrent sessions sharing frames", "[angle_correction][not_integration][frame_store]")
+{
+    char centerline[] = "/2015-05-27_12-02_AngelCorr_tets.cx3/Images/US_10_20150527T131055_Angio_1_tsf_cl1.vtk";
+    char image_prefix[] = "/2015-05-27_12-02_AngelCorr_tets.cx3/US_Acq/US-Acq_10_20150527T131055/US-Acq_10_20150527T131055_Velocity_";
+    const char* filename_a ="/flowdirection_test_shared_a.vtk";
+    const char* filename_b ="/flowdirection_test_shared_b.vtk";
+
+    AngleCorrection reference;
+    reference.setInput(appendTestFolder(centerline), appendTestFolder(image_prefix), 0.312, 0.18, 6, 0.5, 1.0);
+    REQUIRE(reference.calculate());
+    reference.writeDirectionToVtkFile(appendTestFolder(filename_a));
+
+    // Two sessions with different parameters on the same acquisition, running at the same time
+    AngleCorrection angleCorr1;
+    AngleCorrection angleCorr2;
+    angleCorr1.setInput(appendTestFolder(centerline), appendTestFolder(image_prefix), 0.312, 0.18, 6, 0.5, 1.0);
+    angleCorr2.setInput(appendTestFolder(centerline), appendTestFolder(image_prefix), 0.0, 0.5, 2, 0.0, 1.0);
+    std::shared_future<bool> res1 = angleCorr1.calculateAsync();
+    std::shared_future<bool> res2 = angleCorr2.calculateAsync();
+    REQUIRE(res1.get());
+    REQUIRE(res2.get());
+
+    REQUIRE(angleCorr1.getFrameStore());
+    REQUIRE(angleCorr1.getFrameStore() == reference.getFrameStore());
+    REQUIRE(angleCorr2.getFrameStore() == reference.getFrameStore());
+
+    angleCorr1.writeDirectionToVtkFile(appendTestFolder(filename_b));
+    validateFiles(appendTestFolder(filename_a), appendTestFolder(filename_b));
+    std::remove(appendTestFolder(filename_a));
+    std::remove(appendTestFolder(filename_b));
+}
+
+
+TEST_CASE("AngleCorrection: Test single precision pipeline", "[angle_correction][precision]")
+{
+    char centerline[] = "/2015-05-27_12-02_AngelCorr_tets.cx3/Images/US_10_20150527T131055_Angio_1_tsf_cl1.vtk";
+    char image_prefix[] = "/2015-05-27_12-02_AngelCorr_tets.cx3/US_Acq/US-Acq_10_20150527T131055/US-Acq_10_20150527T131055_Velocity_";
+
+    AngleCorrection reference;
+    REQUIRE_NOTHROW(reference.setInput(appendTestFolder(centerline), appendTestFolder(image_prefix), 0.312, 0.18, 6));
+    REQUIRE(reference.calculate());
+
+    AngleCorrectionFloat angleCorr;
+    REQUIRE_NOTHROW(angleCorr.setInput(appendTestFolder(centerline), appendTestFolder(image_prefix), 0.312, 0.18, 6));
+    REQUIRE(angleCorr.calculate());
+    REQUIRE(angleCorr.getFrameStore() == reference.getFrameStore());
+
+    vectorSpline3dDouble splines = reference.getClSpline();
+    AngleCorrectionFloat::SplineVector floatSplines = angleCorr.getClSpline();
+    REQUIRE(floatSplines.size() == splines.size());
+    REQUIRE(angleCorr.getIntersections() == reference.getIntersections());
+    for(size_t k = 0; k < splines.size(); k++)
+    {
+        IntersectionSet<double>& intersections = splines[k].getIntersections();
+        IntersectionSet<float>& floatIntersections = floatSplines[k].getIntersections();
+        REQUIRE(floatIntersections.size() == intersections.size());
+        for(size_t i = 0; i < intersections.size(); i++)
+        {
+            REQUIRE(floatIntersections[i].getMetaImage() == intersections[i].getMetaImage());
+            REQUIRE(std::abs(floatIntersections[i].getParameterPosition() - intersections[i].getParameterPosition()) < 1e-3);
+        }
+        double velocity = intersections.getEstimatedVelocity();
+        double direction = intersections.getEstimatedDirection();
+        REQUIRE(floatIntersections.getEstimatedVelocity() == Approx(velocity).epsilon(0.005));
+        REQUIRE(floatIntersections.getEstimatedDirection() == Approx(direction).epsilon(0.005));
+    }
+}
+
+
+TEST_CASE("AngleCorrection: Test single precision intersections", "[angle_correction][precision][float_intersections]")
+{
+    // Oblique planes through a curve, intersected in double and in single precision
+    for(int N: {300, 2000})
+    {
+        std::vector<double> points[3];
+        std::vector<float> floatPoints[3];
+        for(int i = 0; i < N; i++)
+        {
+            points[0].push_back(40 + 10*std::sin(0.05*i));
+            points[1].push_back(-20 + 0.1*i);
+            points[2].push_back(100 + 5*std::cos(0.013*i));
+        }
+        for(int j = 0; j < 3; j++)
+        {
+            floatPoints[j].assign(points[j].begin(), points[j].end());
+        }
+        std::vector<Plane3D> planeList;
+        for(int k = 0; k < 40; k++)
+        {
+            double coeffs[4] = {0.6, 0.8, 0.0, -0.6*40 - 0.8*(-20 + 0.13*N*k/40.0) - 0.3};
+            planeList.push_back(Plane3D(coeffs));
+        }
+        vector<MetaImage<inData_t> > frames(planeList.size());
+
+        Spline3D<double> spline(N);
+        spline.setPoints(points[0], points[1], points[2]);
+        spline.compute();
+        spline.findAllIntersections(frames, PlaneBatch<double>(planeList));
+        Spline3D<float> floatSpline(N);
+        floatSpline.setPoints(floatPoints[0], floatPoints[1], floatPoints[2]);
+        floatSpline.compute();
+        floatSpline.findAllIntersections(frames, PlaneBatch<float>(planeList));
+
+        IntersectionSet<double>& intersections = spline.getIntersections();
+        IntersectionSet<float>& floatIntersections = floatSpline.getIntersections();
+        REQUIRE(intersections.size() > 0);
+        REQUIRE(floatIntersections.size() == intersections.size());
+        for(size_t i = 0; i < intersections.size(); i++)
+        {
+            REQUIRE(floatIntersections[i].getMetaImage() == intersections[i].getMetaImage());
+            REQUIRE(std::abs(floatIntersections[i].getParameterPosition() - intersections[i].getParameterPosition()) < 1e-3);
+        }
+    }
+}
+
+
+TEST_CASE("AngleCorrection: Test spline fit tridiagonal solver", "[angle_correction][spline_fit]")
+{
+    for(int N: {1, 2, 3, 10, 257})
+    {
+        // The interpolation system as originally formulated, with the end conditions as separate rows
+        const int n = N+2;
+        Eigen::MatrixXd A = Eigen::MatrixXd::Zero(n, n);
+        Eigen::MatrixXd b = Eigen::MatrixXd::Zero(n, 3);
+        A(0,0) = -1; A(0,1) = 1;
+        A(n-1,n-2) = -1; A(n-1,n-1) = 1;
+        std::vector<double> points[3];
+        for(int i = 1; i < n-1; i++)
+        {
+            A(i,i-1) = 0.125; A(i,i) = 0.75; A(i,i+1) = 0.125;
+            for(int a = 0; a < 3; a++)
+            {
+                points[a].push_back(std::sin(0.37*i*(a+1)) + 0.1*i);
+                b(i,a) = points[a].back();
+            }
+        }
+        Eigen::MatrixXd expected = A.fullPivLu().solve(b);
+
+        std::vector<double> cpoints[3];
+        QuadraticSplineFitter<double>::computeControlPoints(points, cpoints);
+        for(int a = 0; a < 3; a++)
+        {
+            REQUIRE(cpoints[a].size() == (size_t)n);
+            QuadraticSplineFitter<double> fitter(points[a]);
+            std::vector<double> single = fitter.compute_control_points();
+            for(int i = 0; i < n; i++)
+            {
+                REQUIRE(cpoints[a][i] == Approx(expected(i,a)).epsilon(1e-12));
+                REQUIRE(single[i] == cpoints[a][i]);
+            }
+        }
+    }
+
+    // Factorizations are shared between fits of the same length, also when fitting in parallel
+    std::shared_ptr<const QuadraticSplineFactorization<double> > factorization = QuadraticSplineFactorization<double>::get(42);
+    REQUIRE(factorization->getNumberOfPoints() == 42);
+    REQUIRE(QuadraticSplineFactorization<double>::get(42) == factorization);
+    TaskScheduler scheduler(4);
+    vector<int> lengths(1000);
+    scheduler.parallelFor(0, lengths.size(), [&](size_t i)
+    {
+        lengths[i] = QuadraticSplineFactorization<double>::get(1 + i % 100)->getNumberOfPoints();
+    });
+    for(size_t i = 0; i < lengths.size(); i++)
+    {
+        REQUIRE(lengths[i] == (int)(1 + i % 100));
+    }
+}
+
+
+TEST_CASE("AngleCorrection: Test closed form smoothing", "[angle_correction][smoothing]")
+{
+    for(int N: {2, 3, 5, 40, 300})
+    {
+        for(int nConvolutions: {0, 1, 2, 6, 30, 100})
+        {
+            Spline3D<double> repeated(N);
+            for(int i = 0; i < N; i++)
+            {
+                double pt[3] = {std::sin(0.3*i), std::cos(0.7*i) + 0.05*i*i, (i % 4)*1.5};
+                repeated.setPoint(i, pt);
+            }
+            Spline3D<double> smoothed = repeated;
+            for(int j = 0; j < nConvolutions; j++)
+            {
+                repeated.applyConvolution({0.25, 0.50, 0.25});
+            }
+            smoothed.smooth(nConvolutions);
+
+            repeated.compute();
+            smoothed.compute();
+            for(double t = 0.0; t <= N-1; t += 0.25)
+            {
+                double expected[3], actual[3];
+                repeated.evaluateSingle(t, expected);
+                smoothed.evaluateSingle(t, actual);
+                for(int a = 0; a < 3; a++)
+                {
+                    REQUIRE(actual[a] == Approx(expected[a]).epsilon(1e-12));
+                }
+            }
+        }
+    }
+
+    // The whole kernel is used in the range of the GUI
+    struct TestSpline : public Spline3D<double>
+    {
+        using Spline3D<double>::binomialKernel;
+    };
+    for(int n: {1, 6, SMOOTHING_FULL_KERNEL_MAX})
+    {
+        std::vector<double> w = TestSpline::binomialKernel(n);
+        REQUIRE(w.size() == (size_t)n+1);
+        double sum = w[0];
+        for(int k = 1; k <= n; k++)
+        {
+            REQUIRE(w[k] > 0.0);
+            sum += 2*w[k];
+        }
+        REQUIRE(sum == Approx(1.0).epsilon(1e-14));
+    }
+    REQUIRE(TestSpline::binomialKernel(10*SMOOTHING_FULL_KERNEL_MAX).size() < (size_t)10*SMOOTHING_FULL_KERNEL_MAX);
+}
+
+
+TEST_CASE("AngleCorrection: Test segment bounding volume hierarchy", "[angle_correction][segment_bvh]")
+{
+    // A winding curve, crossing most planes several times
+    const int N = 1000;
+    std::vector<double> points[3];
+    for(int i = 0; i < N; i++)
+    {
+        points[0].push_back(10*std::sin(0.05*i));
+        points[1].push_back(0.1*i);
+        points[2].push_back(5*std::cos(0.013*i));
+    }
+    SegmentBVH<double> bvh;
+    bvh.build(points);
+
+    auto signAt = [&](const Plane3D& plane, int i)
+    {
+        double pt[3] = {points[0][i], points[1][i], points[2][i]};
+        return sgn(plane.getDistance(pt));
+    };
+    for(int k = 0; k < 200; k++)
+    {
+        // Planes in all directions, some of them through a point of the curve
+        double normal[3] = {std::sin(1.3*k), std::cos(0.7*k), std::sin(0.1*k+0.4)};
+        int through = (k*37) % N;
+        double coeffs[4] = {normal[0], normal[1], normal[2], 0.0};
+        coeffs[3] = -(normal[0]*points[0][through] + normal[1]*points[1][through] + normal[2]*points[2][through]);
+        if(k % 2) coeffs[3] += 0.01*k;
+        Plane3D plane(coeffs);
+
+        int from = (k % 5)*100;
+        int expected = -1;
+        for(int i = from; i+1 < N; i++)
+        {
+            if(signAt(plane, i) != signAt(plane, i+1))
+            {
+                expected = i;
+                break;
+            }
+        }
+        int visited = 0;
+        int found = bvh.findSegment(plane, [&](int i)
+        {
+            visited++;
+            return signAt(plane, i) != signAt(plane, i+1);
+        }, from);
+        REQUIRE(found == expected);
+        REQUIRE(visited <= N);
+
+        // A clear prefix has no crossing
+        for(int to: {0, 1, 10, 100, 500, N-1})
+        {
+            if(!bvh.beforeIsClear(plane, to)) continue;
+            for(int i = 0; i < to; i++)
+            {
+                REQUIRE(signAt(plane, i) == signAt(plane, i+1));
+            }
+        }
+    }
+    double beside[4] = {1.0, 0.0, 0.0, 11.0};
+    REQUIRE(bvh.beforeIsClear(Plane3D(beside), N-1));
+    double through[4] = {0.0, 1.0, 0.0, -50.0};
+    REQUIRE(bvh.beforeIsClear(Plane3D(through), 400));
+    REQUIRE(!bvh.beforeIsClear(Plane3D(through), 600));
+
+    // The crossing found does not depend on where the search starts
+    Spline3D<double> spline(N);
+    spline.setPoints(points[0], points[1], points[2]);
+    spline.compute();
+    for(int k = 0; k < 50; k++)
+    {
+        double coeffs[4] = {std::sin(1.3*k), std::cos(0.7*k), 0.2, 0.0};
+        coeffs[3] = -(coeffs[0]*points[0][k*19] + coeffs[1]*points[1][k*19] + coeffs[2]*points[2][k*19]) + 0.003;
+        Plane3D plane(coeffs);
+        double t0 = 0.0;
+        double pt[3];
+        bool found0 = spline.intersect(t0, plane, pt);
+        for(double start: {-5.0, 1.0, k*19.0, 500.0, 998.0})
+        {
+            double t = start;
+            REQUIRE(spline.intersect(t, plane, pt) == found0);
+            if(found0) REQUIRE(t == t0);
+        }
+    }
+
+    SegmentBVH<double> empty;
+    std::vector<double> single[3] = {{1.0}, {2.0}, {3.0}};
+    empty.build(single);
+    REQUIRE(empty.empty());
+    double coeffs[4] = {1.0, 0.0, 0.0, -1.0};
+    REQUIRE(empty.findSegment(Plane3D(coeffs), [](int){ return true; }) == -1);
+}
+
+
+TEST_CASE("AngleCorrection: Test batched plane distances", "[angle_correction][plane_batch]")
+{
+    const int N = 300;
+    std::vector<double> points[3];
+    for(int i = 0; i < N; i++)
+    {
+        points[0].push_back(40 + 10*std::sin(0.05*i));
+        points[1].push_back(-20 + 0.1*i);
+        points[2].push_back(100 + 5*std::cos(0.013*i));
+    }
+    std::vector<Plane3D> planeList;
+    for(int k = 0; k < 150; k++)
+    {
+        double coeffs[4] = {std::sin(1.3*k), std::cos(0.7*k), std::sin(0.1*k+0.4), -50.0 + k};
+        planeList.push_back(Plane3D(coeffs));
+    }
+    PlaneBatch<double> planes(planeList);
+    REQUIRE(planes.size() == planeList.size());
+
+    PlaneBatch<double>::PointMatrix packed = PlaneBatch<double>::packPoints(points);
+    double maxAbs[3];
+    for(int j = 0; j < 3; j++)
+    {
+        maxAbs[j] = packed.row(j).cwiseAbs().maxCoeff();
+    }
+    PlaneBatch<double>::DistanceMatrix distances;
+    for(size_t first = 0; first < planes.size(); first += PLANE_BATCH_BLOCK_SIZE)
+    {
+        size_t n = std::min((size_t)PLANE_BATCH_BLOCK_SIZE, planes.size()-first);
+        planes.distances(packed, first, n, distances);
+        REQUIRE(distances.rows() == (int)n);
+        REQUIRE(distances.cols() == N);
+        for(size_t f = 0; f < n; f++)
+        {
+            for(int i = 0; i < N; i++)
+            {
+                double pt[3] = {points[0][i], points[1][i], points[2][i]};
+                double expected = planeList[first+f].getDistance(pt);
+                REQUIRE(std::abs(distances(f, i) - expected) <= planes.tolerance(first+f, maxAbs));
+            }
+        }
+    }
+
+    // The dense search and the frame by frame search find the same crossings
+    struct TestSpline : public Spline3D<double>
+    {
+        TestSpline(size_t n) : Spline3D<double>(n) {}
+        using Spline3D<double>::findAllIntersectionsDense;
+        using Spline3D<double>::findAllIntersectionsSearch;
+    };
+    TestSpline spline(N);
+    spline.setPoints(points[0], points[1], points[2]);
+    spline.compute();
+    vector<MetaImage<inData_t> > frames(planes.size());
+    vector<vector<Intersection<double> > > dense(planes.size());
+    vector<vector<Intersection<double> > > search(planes.size());
+    spline.findAllIntersectionsDense(frames, planes, dense);
+    spline.findAllIntersectionsSearch(frames, planes, search);
+    int nFound = 0;
+    for(size_t f = 0; f < planes.size(); f++)
+    {
+        REQUIRE(dense[f].size() == search[f].size());
+        REQUIRE(dense[f].size() <= 1);
+        if(dense[f].empty()) continue;
+        nFound++;
+        REQUIRE(dense[f][0].getParameterPosition() == search[f][0].getParameterPosition());
+        REQUIRE(dense[f][0].getMetaImage() == &frames[f]);
+
+        // and the same as the scalar search for a single plane
+        double t = 0.0;
+        double pt[3];
+        REQUIRE(spline.intersect(t, planeList[f], pt));
+        REQUIRE(t == dense[f][0].getParameterPosition());
+    }
+    REQUIRE(nFound > 0);
+}
+
+
+TEST_CASE("AngleCorrection: Test all crossings per frame", "[angle_correction][all_crossings]")
+{
+    struct TestSpline : public Spline3D<double>
+    {
+        TestSpline(size_t n) : Spline3D<double>(n) {}
+        using Spline3D<double>::findAllIntersectionsDense;
+        using Spline3D<double>::findAllIntersectionsSearch;
+    };
+
+    // A curve winding back and forth through the planes x = c, short enough for the
+    // dense search, and long enough for the frame by frame search
+    for(int N: {300, 2000})
+    {
+        std::vector<double> points[3];
+        for(int i = 0; i < N; i++)
+        {
+            points[0].push_back(10*std::sin(0.05*i));
+            points[1].push_back(0.1*i);
+            points[2].push_back(3*std::cos(0.02*i));
+        }
+        std::vector<Plane3D> planeList;
+        for(int k = 0; k < 20; k++)
+        {
+            double coeffs[4] = {1.0, 0.0, 0.0, -4.75 + 0.5*k};
+            planeList.push_back(Plane3D(coeffs));
+        }
+        PlaneBatch<double> planes(planeList);
+
+        TestSpline spline(N);
+        spline.setPoints(points[0], points[1], points[2]);
+        spline.compute();
+        REQUIRE_FALSE(spline.getAllCrossings());
+        vector<MetaImage<inData_t> > frames(planes.size());
+        vector<vector<Intersection<double> > > first(planes.size());
+        spline.findAllIntersectionsDense(frames, planes, first);
+
+        spline.setAllCrossings(true);
+        vector<vector<Intersection<double> > > dense(planes.size());
+        vector<vector<Intersection<double> > > search(planes.size());
+        spline.findAllIntersectionsDense(frames, planes, dense);
+        spline.findAllIntersectionsSearch(frames, planes, search);
+        for(size_t f = 0; f < planes.size(); f++)
+        {
+            // The planes are far from the turning points, so the spline crosses
+            // wherever the points change side
+            int expected = 0;
+            for(int i = 0; i+1 < N; i++)
+            {
+                double p0[3] = {points[0][i], points[1][i], points[2][i]};
+                double p1[3] = {points[0][i+1], points[1][i+1], points[2][i+1]};
+                if((planeList[f].getDistance(p0) < 0) != (planeList[f].getDistance(p1) < 0)) expected++;
+            }
+            REQUIRE(expected > 1);
+            REQUIRE((int)dense[f].size() == expected);
+            REQUIRE((int)search[f].size() == expected);
+            REQUIRE(first[f].size() == 1);
+            REQUIRE(dense[f][0].getParameterPosition() == first[f][0].getParameterPosition());
+            for(int j = 0; j < expected; j++)
+            {
+                REQUIRE(dense[f][j].getParameterPosition() == search[f][j].getParameterPosition());
+                REQUIRE(dense[f][j].getMetaImage() == &frames[f]);
+                if(j > 0) REQUIRE(dense[f][j].getParameterPosition() > dense[f][j-1].getParameterPosition());
+            }
+        }
+
+        // findAllIntersections() keeps them in frame order, then along the curve
+        spline.findAllIntersections(frames, planes);
+        size_t total = 0;
+        for(size_t f = 0; f < planes.size(); f++) total += dense[f].size();
+        REQUIRE(spline.getIntersections().size() == total);
+    }
+
+    // A curve dipping just through the plane x = c between two points, so that the
+    // spline crosses twice within one segment. Both points next to the dip are
+    // candidates, and the first one is retried on the segment of the second one.
+    const int N = 100;
+    std::vector<double> points[3];
+    for(int i = 0; i < N; i++)
+    {
+        points[0].push_back(0.01*(i-50)*(i-50));
+        points[1].push_back(0.1*i);
+        points[2].push_back(0.0);
+    }
+    double coeffs[4] = {1.0, 0.0, 0.0, -0.0004};
+    std::vector<Plane3D> planeList(1, Plane3D(coeffs));
+    PlaneBatch<double> planes(planeList);
+    TestSpline spline(N);
+    spline.setPoints(points[0], points[1], points[2]);
+    spline.compute();
+    vector<MetaImage<inData_t> > frames(planes.size());
+    vector<vector<Intersection<double> > > first(planes.size());
+    spline.findAllIntersectionsDense(frames, planes, first);
+    REQUIRE(first[0].size() == 1);
+    double t = 0.0;
+    double pt[3];
+    REQUIRE(spline.intersect(t, planeList[0], pt));
+    REQUIRE(first[0][0].getParameterPosition() == t);
+
+    spline.setAllCrossings(true);
+    vector<vector<Intersection<double> > > dense(planes.size());
+    vector<vector<Intersection<double> > > search(planes.size());
+    spline.findAllIntersectionsDense(frames, planes, dense);
+    spline.findAllIntersectionsSearch(frames, planes, search);
+    REQUIRE(dense[0].size() == 2);
+    REQUIRE(search[0].size() == 2);
+    REQUIRE(dense[0][0].getParameterPosition() == t);
+    REQUIRE(dense[0][1].getParameterPosition() > t);
+    for(int j = 0; j < 2; j++)
+    {
+        REQUIRE(search[0][j].getParameterPosition() == dense[0][j].getParameterPosition());
+        double p[3];
+        spline.evaluateSingle(dense[0][j].getParameterPosition(), p);
+        REQUIRE(p[0] == Approx(0.0004));
+    }
+}
+
+
+TEST_CASE("AngleCorrection: Test precomputed frame geometry", "[angle_correction][frame_geometry]")
+{
+    // A rotation about an oblique axis, with an offset
+    Eigen::Matrix3d rotation = Eigen::AngleAxisd(0.7, Eigen::Vector3d(1.0, -2.0, 0.5).normalized()).toRotationMatrix();
+    Matrix4 transform = Matrix4::Identity();
+    transform.block<3,3>(0,0) = rotation;
+    transform.block<3,1>(0,3) = Eigen::Vector3d(12.5, -3.0, 40.0);
+    const double xspacing = 0.3;
+    const double yspacing = 0.45;
+    FrameGeometry geometry(transform, xspacing, yspacing);
+
+    Plane3D plane(transform);
+    for(int i = 0; i < 4; i++)
+    {
+        REQUIRE(geometry.plane[i] == plane.getCoefficient(i));
+    }
+    for(int j = 0; j < 3; j++)
+    {
+        for(int i = 0; i < 3; i++)
+        {
+            REQUIRE(geometry.axes[j][i] == Approx(rotation(i,j)).epsilon(1e-12));
+        }
+    }
+
+    // Pixel coordinates invert the image to world transform
+    for(int k = 0; k < 10; k++)
+    {
+        const double px = 3.0*k;
+        const double py = 50.0 - 2.0*k;
+        Eigen::Vector4d world = transform*Eigen::Vector4d(px*xspacing, py*yspacing, 0.0, 1.0);
+        const double p[3] = {world(0), world(1), world(2)};
+        double x, y;
+        geometry.toImgCoords(x, y, p);
+        REQUIRE(x == Approx(px).epsilon(1e-12));
+        REQUIRE(y == Approx(py).epsilon(1e-12));
+        REQUIRE(std::abs(plane.getDistance(p)) < 1e-12);
+    }
+}
+
+
+TEST_CASE("AngleCorrection: Test batched spline evaluation", "[angle_correction][spline_eval]")
+{
+    const int N = 60;
+    Spline3D<double> spline(N);
+    std::vector<double> x, y, z;
+    for(int i = 0; i < N; i++)
+    {
+        x.push_back(5*std::sin(0.2*i));
+        y.push_back(0.5*i);
+        z.push_back(3*std::cos(0.15*i) + 0.01*i*i);
+    }
+    spline.setPoints(x, y, z);
+    spline.compute();
+
+    // Sorted positions, including the segment boundaries and repeated positions
+    std::vector<double> ts;
+    for(double t = 0; t < N-1; t += 0.3) ts.push_back(t);
+    for(int i = 0; i < N-1; i++) ts.push_back(i + 0.5);
+    ts.push_back(7.25);
+    std::sort(ts.begin(), ts.end());
+
+    std::vector<double> positions[3], derivatives[3];
+    double* positionPtrs[3];
+    double* derivativePtrs[3];
+    for(int a = 0; a < 3; a++)
+    {
+        positions[a].resize(ts.size());
+        derivatives[a].resize(ts.size());
+        positionPtrs[a] = positions[a].data();
+        derivativePtrs[a] = derivatives[a].data();
+    }
+    spline.evaluateMany(ts.data(), ts.size(), positionPtrs);
+    spline.derivativeMany(ts.data(), ts.size(), derivativePtrs);
+    for(size_t k = 0; k < ts.size(); k++)
+    {
+        double p[3], d[3];
+        spline.evaluateSingle(ts[k], p);
+        spline.derivativeSingle(ts[k], d);
+        for(int a = 0; a < 3; a++)
+        {
+            REQUIRE(positions[a][k] == Approx(p[a]).epsilon(1e-12));
+            REQUIRE(derivatives[a][k] == Approx(d[a]).epsilon(1e-12));
+        }
+    }
+}
+
+
+TEST_CASE("AngleCorrection: Test SIMD kernel levels", "[angle_correction][simd]")
+{
+    const SimdLevel best = detectSimdLevel();
+    REQUIRE(simdKernels().level <= best);
+    REQUIRE(simdKernels(SIMD_GENERIC).level == SIMD_GENERIC);
+    REQUIRE(simdKernels(SIMD_AVX512).level == best);
+
+    // Odd sizes, to exercise the loop tails of every vector width
+    const size_t n = 1003;
+    std::vector<double> x(n), y(n), z(n), u(n);
+    std::vector<float> xf(n), yf(n), zf(n), uf(n);
+    for(size_t i = 0; i < n; i++)
+    {
+        x[i] = 40 + 10*std::sin(0.05*i);
+        y[i] = -20 + 0.1*i;
+        z[i] = 100 + 5*std::cos(0.013*i);
+        u[i] = std::fmod(0.37*i, 1.0);
+        xf[i] = x[i];
+        yf[i] = y[i];
+        zf[i] = z[i];
+        uf[i] = u[i];
+    }
+    std::vector<double> planes;
+    for(int k = 0; k < 7; k++)
+    {
+        double coeffs[4] = {std::sin(1.3*k), std::cos(0.7*k), std::sin(0.1*k+0.4), -50.0 + k};
+        planes.insert(planes.end(), coeffs, coeffs+4);
+    }
+    std::vector<float> planesf(planes.begin(), planes.end());
+    const size_t nPlanes = planes.size()/4;
+
+    const SimdKernels& generic = simdKernels(SIMD_GENERIC);
+    std::vector<double> distances(nPlanes*n), quadratic(n), linear(n), actual(nPlanes*n);
+    std::vector<float> distancesf(nPlanes*n), quadraticf(n), linearf(n), actualf(nPlanes*n);
+    generic.planeDistances(planes.data(), nPlanes, x.data(), y.data(), z.data(), n, distances.data());
+    generic.planeDistancesFloat(planesf.data(), nPlanes, xf.data(), yf.data(), zf.data(), n, distancesf.data());
+    generic.quadratic(x[3], y[3], z[3], u.data(), n, quadratic.data());
+    generic.quadraticFloat(xf[3], yf[3], zf[3], uf.data(), n, quadraticf.data());
+    generic.linear(x[3], y[3], u.data(), n, linear.data());
+    generic.linearFloat(xf[3], yf[3], uf.data(), n, linearf.data());
+    for(size_t i = 0; i < n; i += 97)
+    {
+        REQUIRE(quadratic[i] == Approx((z[3]*u[i] + y[3])*u[i] + x[3]));
+        REQUIRE(linear[i] == Approx(y[3]*u[i] + x[3]));
+    }
+    for(size_t f = 0; f < nPlanes; f++)
+    {
+        for(size_t i = 0; i < n; i += 97)
+        {
+            double pt[3] = {x[i], y[i], z[i]};
+            REQUIRE(distances[f*n+i] == Plane3D(&planes[4*f]).getDistance(pt));
+        }
+    }
+
+    // Every level gives the same bits as the generic kernels
+    auto same = [](const void* a, const void* b, size_t bytes)
+    {
+        return std::memcmp(a, b, bytes) == 0;
+    };
+    for(int level = SIMD_GENERIC; level <= best; level++)
+    {
+        const SimdKernels& kernels = simdKernels((SimdLevel)level);
+        INFO(simdLevelName(kernels.level));
+        kernels.planeDistances(planes.data(), nPlanes, x.data(), y.data(), z.data(), n, actual.data());
+        REQUIRE(same(actual.data(), distances.data(), nPlanes*n*sizeof(double)));
+        kernels.planeDistancesFloat(planesf.data(), nPlanes, xf.data(), yf.data(), zf.data(), n, actualf.data());
+        REQUIRE(same(actualf.data(), distancesf.data(), nPlanes*n*sizeof(float)));
+        kernels.quadratic(x[3], y[3], z[3], u.data(), n, actual.data());
+        REQUIRE(same(actual.data(), quadratic.data(), n*sizeof(double)));
+        kernels.quadraticFloat(xf[3], yf[3], zf[3], uf.data(), n, actualf.data());
+        REQUIRE(same(actualf.data(), quadraticf.data(), n*sizeof(float)));
+        kernels.linear(x[3], y[3], u.data(), n, actual.data());
+        REQUIRE(same(actual.data(), linear.data(), n*sizeof(double)));
+        kernels.linearFloat(xf[3], yf[3], uf.data(), n, actualf.data());
+        REQUIRE(same(actualf.data(), linearf.data(), n*sizeof(float)));
+
+        // In place, as in Spline3D::evaluateMany()
+        std::copy(u.begin(), u.end(), actual.begin());
+        kernels.quadratic(x[3], y[3], z[3], actual.data(), n, actual.data());
+        REQUIRE(same(actual.data(), quadratic.data(), n*sizeof(double)));
+        std::copy(uf.begin(), uf.end(), actualf.begin());
+        kernels.linearFloat(xf[3], yf[3], actualf.data(), n, actualf.data());
+        REQUIRE(same(actualf.data(), linearf.data(), n*sizeof(float)));
+    }
+}
+
+
+TEST_CASE("AngleCorrection: Test batched quadratic roots", "[angle_correction][quadratic_roots]")
+{
+    typedef QuadraticRoots<double>::Array Array;
+    typedef QuadraticRoots<double>::IndexArray IndexArray;
+
+    // Two roots in [0,1], one in [0,1], a double root, a slightly negative discriminant, complex roots
+    Array a(5), b(5), c(5), root(5), second(5);
+    IndexArray count(5);
+    a << 1.0, 1.0, 1.0, 1.0, 1.0;
+    b << -1.0, -1.5, -1.0, -1.0, 0.0;
+    c << 0.21, 0.44, 0.25, 0.25 + 0.001, 1.0;
+    QuadraticRoots<double>::solve(a, b, c, root, second, count);
+    REQUIRE(count(0) == 2);
+    REQUIRE(root(0) == Approx(0.7));
+    REQUIRE(second(0) == Approx(0.3));
+    REQUIRE(count(1) == 1);
+    REQUIRE(root(1) == Approx(0.4));
+    REQUIRE(count(2) == 1);
+    REQUIRE(root(2) == 0.5);
+    REQUIRE(count(3) == 1);
+    REQUIRE(root(3) == 0.5);
+    REQUIRE(count(4) == 0);
+
+    // Same results as the scalar solver on real spline segments
+    struct TestSpline : public Spline3D<double>
+    {
+        TestSpline(size_t n) : Spline3D<double>(n) {}
+        using Spline3D<double>::findRoots;
+        using Spline3D<double>::crossingCoefficients;
+    };
+    const int N = 200;
+    std::vector<double> points[3];
+    for(int i = 0; i < N; i++)
+    {
+        points[0].push_back(10*std::sin(0.05*i));
+        points[1].push_back(0.1*i);
+        points[2].push_back(5*std::cos(0.013*i));
+    }
+    TestSpline spline(N);
+    spline.setPoints(points[0], points[1], points[2]);
+    spline.compute();
+
+    const int n = 1000;
+    Array ba(n), bb(n), bc(n), broot(n), bsecond(n);
+    IndexArray bcount(n);
+    vector<Plane3D> planes;
+    for(int k = 0; k < n; k++)
+    {
+        double coeffs[4] = {std::sin(1.3*k), std::cos(0.7*k), std::sin(0.1*k+0.4), 0.0};
+        int i = k % (N-1);
+        coeffs[3] = -(coeffs[0]*points[0][i] + coeffs[1]*points[1][i] + coeffs[2]*points[2][i]) + 0.01*(k % 7);
+        planes.push_back(Plane3D(coeffs));
+        spline.crossingCoefficients(i, planes.back(), ba(k), bb(k), bc(k));
+    }
+    QuadraticRoots<double>::solve(ba, bb, bc, broot, bsecond, bcount);
+    int nRoots = 0;
+    for(int k = 0; k < n; k++)
+    {
+        double roots[2];
+        int expected = spline.findRoots(k % (N-1), planes[k], roots);
+        REQUIRE(bcount(k) == expected);
+        if(expected > 0)
+        {
+            REQUIRE(broot(k) == roots[0]);
+            if(expected > 1) REQUIRE(bsecond(k) == roots[1]);
+            nRoots++;
+        }
+    }
+    REQUIRE(nRoots > 0);
+}
+
+
+TEST_CASE("AngleCorrection: Test intersection set estimators", "[angle_correction][intersection_set]")
+{
+    // Intersections with mixed signs and angles, including some without points,
+    // compared with the estimators evaluated per intersection
+    IntersectionSet<double> intersections;
+    const int n = 300;
+    for(int k = 0; k < n; k++)
+    {
+        Intersection<double> intersection;
+        intersection.setValid(true);
+        intersection.setCosTheta(std::sin(0.37*k + 0.1));
+        vector<double> points;
+        int nPoints = (k % 11 == 0) ? 0 : 1 + k % 17;
+        for(int i = 0; i < nPoints; i++)
+        {
+            points.push_back(0.2*std::sin(0.9*k + 1.7*i) + 0.05);
+        }
+        intersection.setPoints(points);
+        intersections.push_back(intersection);
+    }
+
+    const double A = 10.0, dirA = 0.07, dirB = 0.9;
+    double num = 0.0, den = 0.0;
+    double top = 0.0, bottom = 0.0;
+    for(int k = 0; k < n; k++)
+    {
+        Intersection<double> i = intersections[k];
+        double weight = i.sampleWeight(A, dirA, dirB);
+        double tmp = i.getAverage()*i.getCosTheta();
+        tmp = weight*tmp/std::abs(tmp);
+        if(!std::isnan(tmp))
+        {
+            num += tmp;
+            den += weight;
+        }
+        if(std::abs(i.getCosTheta()) >= 0.17)
+        {
+            top += i.getAverage()*i.getCosTheta();
+            bottom += i.getCosTheta()*i.getCosTheta();
+        }
+    }
+    REQUIRE(den > 0.0);
+    REQUIRE(intersections.getEstimatedDirection() == Approx(num/den));
+    REQUIRE(intersections.getEstimatedVelocity() == Approx(top/bottom));
+
+    // In-place changes are picked up by updateStatistics()
+    for(auto &intersection: intersections)
+    {
+        intersection.setCosTheta(-intersection.getCosTheta());
+    }
+    intersections.updateStatistics();
+    intersections.estimateDirection();
+    intersections.estimateVelocityLS();
+    REQUIRE(intersections.getEstimatedDirection() == Approx(-num/den));
+    REQUIRE(intersections.getEstimatedVelocity() == Approx(-top/bottom));
+
+    // Changes through the set are picked up by the next estimate, also when the size stays the same
+    for(auto &intersection: intersections)
+    {
+        intersection.setCosTheta(-intersection.getCosTheta());
+    }
+    intersections.estimateDirection();
+    intersections.estimateVelocityLS();
+    REQUIRE(intersections.getEstimatedDirection() == Approx(num/den));
+    REQUIRE(intersections.getEstimatedVelocity() == Approx(top/bottom));
+    Intersection<double> replaced = intersections[1];
+    replaced.setCosTheta(-replaced.getCosTheta());
+    intersections[1] = replaced;
+    intersections.estimateVelocityLS();
+    REQUIRE(intersections.getEstimatedVelocity() == Approx((top + 2*replaced.getAverage()*replaced.getCosTheta())/bottom));
+    IntersectionSet<double> copy;
+    copy = intersections;
+    copy.estimateVelocityLS();
+    REQUIRE(copy.getEstimatedVelocity() == intersections.getEstimatedVelocity());
+
+    IntersectionSet<double> empty;
+    REQUIRE(empty.getEstimatedDirection() == 0.0);
+    REQUIRE(empty.getEstimatedVelocity() == 0.0);
+}
+
+
+TEST_CASE("AngleCorrection: Test fused region statistics", "[angle_correction][region_statistics]")
+{
+    // Velocities of both signs and some exact zeros, an odd size for the loop tails
+    const size_t n = 517;
+    std::vector<double> v(n);
+    std::vector<float> vf(n);
+    size_t positive = 0, negative = 0;
+    double positiveSum = 0.0, negativeSum = 0.0;
+    for(size_t i = 0; i < n; i++)
+    {
+        v[i] = (i % 13 == 0) ? 0.0 : 0.3*std::sin(0.7*i) + 0.05;
+        vf[i] = v[i];
+        positive += v[i] > 0;
+        negative += v[i] < 0;
+        positiveSum += v[i] > 0 ? v[i] : 0.0;
+        negativeSum += v[i] < 0 ? v[i] : 0.0;
+    }
+
+    RegionStatistics generic, genericf;
+    simdKernels(SIMD_GENERIC).regionStatistics(v.data(), n, &generic);
+    simdKernels(SIMD_GENERIC).regionStatisticsFloat(vf.data(), n, &genericf);
+    REQUIRE(generic.count == n);
+    REQUIRE(generic.positive == positive);
+    REQUIRE(generic.negative == negative);
+    REQUIRE(generic.positiveSum == Approx(positiveSum));
+    REQUIRE(generic.negativeSum == Approx(negativeSum));
+    REQUIRE(generic.sum == Approx(positiveSum + negativeSum));
+    for(int level = SIMD_GENERIC; level <= detectSimdLevel(); level++)
+    {
+        const SimdKernels& kernels = simdKernels((SimdLevel)level);
+        INFO(simdLevelName(kernels.level));
+        RegionStatistics statistics, statisticsf;
+        kernels.regionStatistics(v.data(), n, &statistics);
+        kernels.regionStatisticsFloat(vf.data(), n, &statisticsf);
+        // The same bits on every level
+        REQUIRE(statistics.sum == generic.sum);
+        REQUIRE(statistics.positiveSum == generic.positiveSum);
+        REQUIRE(statistics.negativeSum == generic.negativeSum);
+        REQUIRE(statistics.positive == generic.positive);
+        REQUIRE(statisticsf.sum == genericf.sum);
+        REQUIRE(statisticsf.positiveSum == genericf.positiveSum);
+        REQUIRE(statisticsf.negative == genericf.negative);
+    }
+
+    // The intersection caches the statistics when its points are set
+    Intersection<double> intersection;
+    intersection.setValid(true);
+    intersection.setCosTheta(0.5);
+    intersection.setPoints(v);
+    REQUIRE(intersection.getNumberOfPoints() == (int)n);
+    REQUIRE(intersection.getPositiveCount() == (int)positive);
+    REQUIRE(intersection.getAverage() == generic.sum/n);
+    double weight = (double)(2*(int)positive - (int)n)/n;
+    REQUIRE(intersection.sampleWeight(10.0, 0.07, 0.9) == Approx(10.0*weight*weight + 1.0));
+    intersection.setPoints(vector<double>());
+    REQUIRE(intersection.getAverage() == 0.0);
+    REQUIRE(!intersection.isValid());
+}
+
+
+TEST_CASE("AngleCorrection: Test closed form aliasing correction", "[angle_correction][aliasing_correction]")
+{
+    vector<double> points;
+    for(int i = 0; i < 211; i++)
+    {
+        points.push_back((i % 17 == 0) ? 0.0 : 0.3*std::sin(0.45*i) + 0.04);
+    }
+
+    for(double cosTheta: {0.6, -0.6})
+    {
+        for(double direction: {1.0, -1.0})
+        {
+            for(double Vnyq: {0.31, 0.5})
+            {
+                // Correct every point, as the pixel data used to be rewritten
+                bool sign = sgn(direction) == sgn(cosTheta);
+                double expected = 0.0;
+                for(double v: points)
+                {
+                    if(v < 0 && sign) v += 2*Vnyq;
+                    else if(v > 0 && !sign) v -= 2*Vnyq;
+                    expected += v;
+                }
+                expected /= points.size();
+
+                Intersection<double> intersection;
+                intersection.setValid(true);
+                intersection.setCosTheta(cosTheta);
+                intersection.setPoints(points);
+                double original = intersection.getAverage();
+                intersection.correctAliasing(direction, Vnyq);
+                REQUIRE(intersection.getAverage() == Approx(expected));
+                // Running it again does not correct twice
+                intersection.correctAliasing(direction, Vnyq);
+                REQUIRE(intersection.getAverage() == Approx(expected));
+                REQUIRE(intersection.getOrigAvgValue() == original);
+            }
+        }
+    }
+
+    Intersection<float> empty;
+    empty.setValid(true);
+    empty.setPoints(vector<float>());
+    empty.correctAliasing(1.0f, 0.3f);
+    REQUIRE(empty.getAverage() == 0.0f);
+    REQUIRE(!empty.isValid());
+}
+
+
+TEST_CASE("AngleCorrection: Test rerunning aliasing correction", "[angle_correction][aliasing_correction]")
+{
+    // Changing Vnyq only runs aliasing correction and velocity estimation again,
+    // which must give the same result as a run from scratch
+    auto makeSet = []()
+    {
+        IntersectionSet<double> intersections;
+        for(int k = 0; k < 120; k++)
+        {
+            Intersection<double> intersection;
+            intersection.setValid(true);
+            intersection.setCosTheta(0.2 + 0.7*std::fabs(std::sin(0.3*k)));
+            vector<double> points;
+            for(int i = 0; i < 1 + k % 9; i++)
+            {
+                points.push_back(0.25*std::sin(0.8*k + 1.1*i) + 0.1);
+            }
+            intersection.setPoints(points);
+            intersections.push_back(intersection);
+        }
+        return intersections;
+    };
+    auto run = [](IntersectionSet<double>& intersections, double Vnyq, double cutoff)
+    {
+        intersections.correctAliasing(Vnyq);
+        intersections.setVelocityEstimationCutoff(cutoff, 1.0);
+        intersections.estimateVelocityLS();
+        return intersections.getEstimatedVelocity();
+    };
+
+    IntersectionSet<double> intersections = makeSet();
+    intersections.estimateDirection();
+    const double direction = intersections.getEstimatedDirection();
+    const double velocity = run(intersections, 0.3, 0.18);
+    REQUIRE(run(intersections, 0.5, 0.18) != velocity);
+    REQUIRE(run(intersections, 0.5, 0.5) != velocity);
+    REQUIRE(run(intersections, 0.3, 0.18) == velocity);
+
+    // Without correction the uncorrected averages are used again
+    IntersectionSet<double> uncorrected = makeSet();
+    uncorrected.estimateVelocityLS();
+    REQUIRE(run(intersections, 0.0, 0.18) == uncorrected.getEstimatedVelocity());
+
+    // Direction estimation always uses the uncorrected averages
+    run(intersections, 0.3, 0.18);
+    intersections.estimateDirection();
+    REQUIRE(intersections.getEstimatedDirection() == direction);
+}
+
+
+TEST_CASE("AngleCorrection: Test spline cache", "[angle_correction][spline_cache]")
+{
+    const int N = 200;
+    std::vector<double> points[3];
+    for(int i = 0; i < N; i++)
+    {
+        points[0].push_back(0.1*i);
+        points[1].push_back(std::sin(0.05*i));
+        points[2].push_back(0.0);
+    }
+    std::vector<Plane3D> planeList;
+    for(int k = 0; k < 10; k++)
+    {
+        double coeffs[4] = {1.0, 0.0, 0.0, -1.05 - 1.5*k};
+        planeList.push_back(Plane3D(coeffs));
+    }
+    vector<MetaImage<inData_t> > frames(planeList.size());
+    SplineCache<double>::SplineVector splines(1, Spline3D<double>(N));
+    splines[0].setPoints(points[0], points[1], points[2]);
+    splines[0].compute();
+    splines[0].findAllIntersections(frames, PlaneBatch<double>(planeList));
+    REQUIRE(splines[0].getIntersections().size() == planeList.size());
+
+    // Copies of a spline have intersections referring to the copy
+    SplineCache<double>::SplineVector copy = splines;
+    copy.push_back(copy[0]);
+    for(auto &spline: copy)
+    {
+        REQUIRE(spline.getIntersections().size() == planeList.size());
+        for(auto &intersection: spline.getIntersections())
+        {
+            REQUIRE(intersection.getSpline() == &spline);
+        }
+    }
+
+    // Branches are recognized by the hash of their points, whatever else was computed for them
+    REQUIRE(copy[1].hashPoints() == splines[0].hashPoints());
+    Spline3D<double> edited(N);
+    edited.setPoints(points[0], points[1], points[2]);
+    REQUIRE(edited.hashPoints() == splines[0].hashPoints());
+    double moved[3] = {points[0][N/2], points[1][N/2] + 0.01, points[2][N/2]};
+    edited.setPoint(N/2, moved);
+    REQUIRE(edited.hashPoints() != splines[0].hashPoints());
+
+    // Least recently used entries are dropped first
+    SplineCache<double> cache(2);
+    REQUIRE(cache.lookup(1, 6) == NULL);
+    cache.store(1, 6, splines, FrameStore::Ptr(), false);
+    cache.store(1, 7, splines, FrameStore::Ptr(), false);
+    const SplineCache<double>::Entry* entry = cache.lookup(1, 6);
+    REQUIRE(entry != NULL);
+    REQUIRE(entry->splines.size() == 1);
+    REQUIRE(entry->splines[0].getConstIntersections()[0].getSpline() == &entry->splines[0]);
+    REQUIRE(!entry->hasIntersections(FrameStore::Ptr(), false));
+    cache.store(2, 6, splines, FrameStore::Ptr(), false);
+    REQUIRE(cache.size() == 2);
+    REQUIRE(cache.lookup(1, 7) == NULL);
+    REQUIRE(cache.lookup(1, 6) != NULL);
+    REQUIRE(cache.lookup(2, 6) != NULL);
+    REQUIRE(cache.getHits() == 3);
+    REQUIRE(cache.getMisses() == 2);
+
+    // Storing the same key again replaces the entry
+    cache.store(2, 6, copy, FrameStore::Ptr(), true);
+    REQUIRE(cache.size() == 2);
+    REQUIRE(cache.lookup(2, 6)->splines.size() == 2);
+    cache.setCapacity(0);
+    REQUIRE(cache.size() == 0);
+    cache.store(1, 6, splines, FrameStore::Ptr(), false);
+    REQUIRE(cache.lookup(1, 6) == NULL);
+
+    // The hash sees every byte, in the lanes and in the tail
+    std::vector<double> a(100003);
+    for(size_t i = 0; i < a.size(); i++)
+    {
+        a[i] = std::sin(0.01*i);
+    }
+    std::vector<double> b = a;
+    const uint64_t hash = hashBytes(HASH_SEED, a.data(), a.size()*sizeof(double));
+    REQUIRE(hashBytes(HASH_SEED, b.data(), b.size()*sizeof(double)) == hash);
+    for(size_t i: {size_t(0), size_t(1), size_t(2), size_t(3), size_t(50000), a.size()-1})
+    {
+        b[i] = std::nextafter(a[i], 4.0);
+        REQUIRE(hashBytes(HASH_SEED, b.data(), b.size()*sizeof(double)) != hash);
+        b[i] = a[i];
+    }
+    REQUIRE(hashBytes(HASH_SEED, a.data(), 8) != hashBytes(HASH_SEED, a.data(), 16));
+    REQUIRE(hashBytes(HASH_SEED, a.data(), 0) != hashBytes(HASH_SEED + 1, a.data(), 0));
+}
+
+TEST_CASE("AngleCorrection: Test centerline topology", "[angle_correction][spline_build]")
+{
+    // A trunk 0-5 splitting at 5 into 6-10 and 11-14, which splits at 8 into 15-18,
+    // with the lines given out of order and in both directions
+    const int N = 19;
+    std::vector<int> edges = {5, 4, 0, 1, 1, 2, 3, 2, 3, 4,
+                              5, 11, 11, 12, 12, 13, 13, 14,
+                              5, 6, 6, 7, 8, 7, 8, 9, 9, 10,
+                              8, 15, 15, 16, 16, 17, 18, 17};
+    AdjList graph(N, edges);
+    REQUIRE(graph.size() == N);
+    REQUIRE(graph.degree(5) == 3);
+    REQUIRE(graph.degree(8) == 3);
+    REQUIRE(graph.findAllFirst() == std::vector<int>({0, 10, 14, 18}));
+    // The neighbours come in the order of the edges
+    std::vector<int> next;
+    REQUIRE(graph.findAllNext(5, next) == 3);
+    REQUIRE(next == std::vector<int>({4, 11, 6}));
+    REQUIRE(graph.findAllNext(8, next) == 3);
+    REQUIRE(next == std::vector<int>({4, 11, 6, 7, 9, 15}));
+
+    std::vector<double> xyz(3*N);
+    for(int i = 0; i < N; i++)
+    {
+        xyz[3*i] = i;
+        xyz[3*i+1] = std::sin(0.7*i);
+        xyz[3*i+2] = 0.1*i*i;
+    }
+
+    // The depth first search of the original implementation, one vector per spline
+    std::vector<std::vector<int> > adjacent(N);
+    for(size_t e = 0; e < edges.size(); e += 2)
+    {
+        adjacent[edges[e]].push_back(edges[e+1]);
+        adjacent[edges[e+1]].push_back(edges[e]);
+    }
+    std::vector<char> visited(N, 0);
+    std::vector<std::vector<int> > runs(1);
+    std::vector<int> stack;
+    std::vector<std::pair<int,int> > parents;
+    for(int i = N-1; i >= 0; i--)
+    {
+        if(adjacent[i].size() != 1) continue;
+        stack.push_back(i);
+        parents.push_back(std::pair<int,int>(-1, -1));
+    }
+    while(!stack.empty())
+    {
+        int node = stack.back();
+        stack.pop_back();
+        parents.pop_back();
+        runs.back().push_back(node);
+        visited[node] = 1;
+        std::vector<int> children;
+        for(int a: adjacent[node])
+        {
+            if(!visited[a]) children.push_back(a);
+        }
+        if(children.size() != 1 && !stack.empty())
+        {
+            std::pair<int,int> parent = parents.back();
+            runs.push_back(std::vector<int>());
+            if(parent.second != -1) runs.back().push_back(runs[parent.first][parent.second]);
+        }
+        stack.insert(stack.end(), children.begin(), children.end());
+        for(size_t c = 0; c < children.size(); c++)
+        {
+            parents.push_back(std::pair<int,int>(runs.size()-1, (int)runs.back().size()-1));
+        }
+    }
+
+    std::unique_ptr<std::vector<Spline3D<double> > > splines(Spline3D<double>::build(graph, xyz.data()));
+    REQUIRE(graph.isVisited(18));
+    size_t s = 0;
+    for(auto &run: runs)
+    {
+        if(run.size() <= 1) continue;
+        REQUIRE(s < splines->size());
+        std::vector<double> points[3];
+        for(int node: run)
+        {
+            for(int i = 0; i < 3; i++)
+            {
+                points[i].push_back(xyz[3*node+i]);
+            }
+        }
+        Spline3D<double> expected(run.size());
+        expected.setPoints(points[0], points[1], points[2]);
+        REQUIRE((*splines)[s].getLength() == run.size());
+        REQUIRE((*splines)[s].hashPoints() == expected.hashPoints());
+        s++;
+    }
+    REQUIRE(s == splines->size());
+    REQUIRE(s >= 4);
+
+    // Coordinates stored as float give the same splines
+    std::vector<float> xyzFloat(xyz.begin(), xyz.end());
+    AdjList graphFloat(N, edges);
+    std::unique_ptr<std::vector<Spline3D<float> > > splinesFloat(Spline3D<float>::build(graphFloat, xyzFloat.data()));
+    REQUIRE(splinesFloat->size() == splines->size());
+}
+
+TEST_CASE("AngleCorrection: Test asynchronous calculation and cancel", "[angle_correction][async]")
+{
+    char centerline[] = "/2015-05-27_12-02_AngelCorr_tets.cx3/Images/US_01_20150527T125724_Angio_1_tsf_cl1.vtk";
+    char image_prefix[] = "/2015-05-27_12-02_AngelCorr_tets.cx3/US_Acq/US-Acq_01_20150527T125724_raw/US-Acq_01_20150527T125724_Velocity_";
+    double true_flow [1]={-0.465};
+
+    AngleCorrection angleCorr = AngleCorrection();
+    REQUIRE_NOTHROW(angleCorr.setInput(appendTestFolder(centerline), appendTestFolder(image_prefix), 0.312, 0.18, 6));
+
+    // A second call while running gives the running calculation, which is then cancelled
+    std::shared_future<bool> first = angleCorr.calculateAsync();
+    std::shared_future<bool> second = angleCorr.calculateAsync();
+    angleCorr.cancel();
+    REQUIRE(!first.get());
+    REQUIRE(!second.get());
+    REQUIRE(angleCorr.wasCancelled());
+    REQUIRE(!angleCorr.isCalculating());
+    REQUIRE(angleCorr.getOutput().GetPointer() == NULL);
+
+    // The next run continues from the stages that were completed, and gives the same result
+    std::shared_future<bool> result = angleCorr.calculateAsync();
+    REQUIRE(result.get());
+    REQUIRE(!angleCorr.wasCancelled());
+    REQUIRE(angleCorr.getOutput().GetPointer() != NULL);
+    const CalculationProgress& progress = angleCorr.getProgress();
+    REQUIRE(progress.getDone() > 0);
+    REQUIRE(progress.getDone() == progress.getTotal());
+    validateFlowDirection_FlowVel(angleCorr.getClSpline(), true_flow);
+
+    // Nothing left to do with the same input
+    REQUIRE_NOTHROW(angleCorr.setInput(appendTestFolder(centerline), appendTestFolder(image_prefix), 0.312, 0.18, 6));
+    REQUIRE(angleCorr.calculate());
+    REQUIRE(angleCorr.getNumOfStepsRan() == 0);
+}
+
+TEST_CASE("AngleCorrection: Test replacing the centerline points during a calculation", "[angle_correction][centerline_snapshot]")
+{
+    char centerline[] = "/2015-05-27_12-02_AngelCorr_tets.cx3/Images/US_01_20150527T125724_Angio_1_tsf_cl1.vtk";
+    char image_prefix[] = "/2015-05-27_12-02_AngelCorr_tets.cx3/US_Acq/US-Acq_01_20150527T125724_raw/US-Acq_01_20150527T125724_Velocity_";
+    double true_flow [1]={-0.465};
+
+    vtkSmartPointer<vtkPolyDataReader> reader = vtkSmartPointer<vtkPolyDataReader>::New();
+    reader->SetFileName(appendTestFolder(centerline));
+    reader->Update();
+    vtkSmartPointer<vtkPolyData> polydata = reader->GetOutput();
+
+    AngleCorrection angleCorr = AngleCorrection();
+    REQUIRE_NOTHROW(angleCorr.setInput(polydata, appendTestFolder(image_prefix), 0.312, 0.18, 6));
+    std::shared_future<bool> result = angleCorr.calculateAsync();
+
+    // The calculation reads the points it was given, replacing them does not interfere
+    vtkSmartPointer<vtkPoints> moved = vtkSmartPointer<vtkPoints>::New();
+    moved->DeepCopy(polydata->GetPoints());
+    for(vtkIdType i = 0; i < moved->GetNumberOfPoints(); i++)
+    {
+        double pt[3];
+        moved->GetPoint(i, pt);
+        pt[2] += 0.001;
+        moved->SetPoint(i, pt);
+    }
+    polydata->SetPoints(moved);
+    REQUIRE(result.get());
+    validateFlowDirection_FlowVel(angleCorr.getClSpline(), true_flow);
+
+    // and the next calculation sees the new ones
+    REQUIRE_NOTHROW(angleCorr.setInput(polydata, appendTestFolder(image_prefix), 0.312, 0.18, 6));
+    REQUIRE(angleCorr.calculate());
+    REQUIRE(angleCorr.getNumOfStepsRan() == 2);
+    validateFlowDirection_FlowVel(angleCorr.getClSpline(), true_flow);
+}
+
+TEST_CASE("AngleCorrection: Test editing one blood vessel", "[angle_correction][branch_reuse]")
+{
+    char centerline[] = "/2015-05-27_12-02_AngelCorr_tets.cx3/Images/US_10_20150527T131055_Angio_1_tsf_cl1.vtk";
+    char image_prefix[] = "/2015-05-27_12-02_AngelCorr_tets.cx3/US_Acq/US-Acq_10_20150527T131055/US-Acq_10_20150527T131055_Velocity_";
+    // The same frames under another name, so they are loaded again into another FrameStore
+    char other_prefix[] = "/./2015-05-27_12-02_AngelCorr_tets.cx3/US_Acq/US-Acq_10_20150527T131055/US-Acq_10_20150527T131055_Velocity_";
+    const double Vnyq = 0.312;
+    const double cutoff = 0.18;
+    const int nConvolutions = 6;
+    const double uncertainty_limit = 0.5;
+    const double minArrowDist = 1.0;
+
+    vtkSmartPointer<vtkPolyDataReader> reader = vtkSmartPointer<vtkPolyDataReader>::New();
+    reader->SetFileName(appendTestFolder(centerline));
+    reader->Update();
+    vtkSmartPointer<vtkPolyData> polydata = reader->GetOutput();
+    vtkSmartPointer<vtkPoints> original = vtkSmartPointer<vtkPoints>::New();
+    original->DeepCopy(polydata->GetPoints());
+
+    // A point on exactly two lines is inside a blood vessel, moving it only changes that one
+    std::vector<int> lineCount(polydata->GetNumberOfPoints(), 0);
+    vtkCellArray* lines = polydata->GetLines();
+    vtkSmartPointer<vtkIdList> ids = vtkSmartPointer<vtkIdList>::New();
+    lines->InitTraversal();
+    while(lines->GetNextCell(ids))
+    {
+        for(vtkIdType i = 0; i < ids->GetNumberOfIds(); i++)
+        {
+            lineCount[ids->GetId(i)]++;
+        }
+    }
+    const vtkIdType edited = std::find(lineCount.begin(), lineCount.end(), 2) - lineCount.begin();
+    REQUIRE(edited < (vtkIdType)lineCount.size());
+    auto movePoint = [&](double dz)
+    {
+        vtkSmartPointer<vtkPoints> points = vtkSmartPointer<vtkPoints>::New();
+        points->DeepCopy(polydata->GetPoints());
+        double pt[3];
+        points->GetPoint(edited, pt);
+        pt[2] += dz;
+        points->SetPoint(edited, pt);
+        polydata->SetPoints(points);
+    };
+
+    // The result of a run reusing blood vessels is the same as that of a run from scratch
+    auto compareWithColdRun = [&](AngleCorrection& warm, bool allCrossings)
+    {
+        AngleCorrection cold = AngleCorrection();
+        cold.setReportAllCrossings(allCrossings);
+        REQUIRE_NOTHROW(cold.setInput(polydata, appendTestFolder(image_prefix), Vnyq, cutoff, nConvolutions, uncertainty_limit, minArrowDist));
+        REQUIRE(cold.calculate());
+        vectorSpline3dDouble warmSplines = warm.getClSpline();
+        vectorSpline3dDouble coldSplines = cold.getClSpline();
+        REQUIRE(cold.getBloodVesselsSmoothed() == (int)coldSplines.size());
+        REQUIRE(warmSplines.size() == coldSplines.size());
+        for(size_t k = 0; k < coldSplines.size(); k++)
+        {
+            REQUIRE(warmSplines[k].getIntersections().size() == coldSplines[k].getIntersections().size());
+            REQUIRE(warmSplines[k].getIntersections().getEstimatedDirection() == coldSplines[k].getIntersections().getEstimatedDirection());
+            REQUIRE(warmSplines[k].getIntersections().getEstimatedVelocity() == coldSplines[k].getIntersections().getEstimatedVelocity());
+        }
+        validateVtkPD(warm.getOutput(), cold.getOutput());
+    };
+
+    AngleCorrection angleCorr = AngleCorrection();
+    REQUIRE_NOTHROW(angleCorr.setInput(polydata, appendTestFolder(image_prefix), Vnyq, cutoff, nConvolutions, uncertainty_limit, minArrowDist));
+    REQUIRE(angleCorr.calculate());
+    const int nBloodVessels = angleCorr.getClSpline().size();
+    REQUIRE(nBloodVessels > 1);
+    REQUIRE(angleCorr.getBloodVesselsSmoothed() == nBloodVessels);
+    REQUIRE(angleCorr.getBloodVesselsIntersected() == nBloodVessels);
+
+    // Only the edited blood vessel is smoothed, fitted, intersected and region grown again
+    movePoint(0.05);
+    REQUIRE_NOTHROW(angleCorr.setInput(polydata, appendTestFolder(image_prefix), Vnyq, cutoff, nConvolutions, uncertainty_limit, minArrowDist));
+    REQUIRE(angleCorr.calculate());
+    REQUIRE(angleCorr.getBloodVesselsSmoothed() == 1);
+    REQUIRE(angleCorr.getBloodVesselsIntersected() == 1);
+    compareWithColdRun(angleCorr, false);
+
+    // With another crossing mode the others keep their smoothing, but are intersected again
+    movePoint(0.05);
+    angleCorr.setReportAllCrossings(true);
+    REQUIRE_NOTHROW(angleCorr.setInput(polydata, appendTestFolder(image_prefix), Vnyq, cutoff, nConvolutions, uncertainty_limit, minArrowDist));
+    REQUIRE(angleCorr.calculate());
+    REQUIRE(angleCorr.getBloodVesselsSmoothed() == 1);
+    REQUIRE(angleCorr.getBloodVesselsIntersected() == nBloodVessels);
+    compareWithColdRun(angleCorr, true);
+
+    // The same with other frames
+    movePoint(0.05);
+    REQUIRE_NOTHROW(angleCorr.setInput(polydata, appendTestFolder(other_prefix), Vnyq, cutoff, nConvolutions, uncertainty_limit, minArrowDist));
+    REQUIRE(angleCorr.calculate());
+    REQUIRE(angleCorr.getBloodVesselsSmoothed() == 1);
+    REQUIRE(angleCorr.getBloodVesselsIntersected() == nBloodVessels);
+    compareWithColdRun(angleCorr, true);
+
+    // Going back to the first centerline takes the smoothed blood vessels from the spline cache,
+    // but their intersections were found in the first frames with the first crossing mode
+    polydata->SetPoints(original);
+    const size_t hits = angleCorr.getSplineCacheHits();
+    REQUIRE_NOTHROW(angleCorr.setInput(polydata, appendTestFolder(image_prefix), Vnyq, cutoff, nConvolutions, uncertainty_limit, minArrowDist));
+    REQUIRE(angleCorr.calculate());
+    REQUIRE(angleCorr.getSplineCacheHits() == hits + 1);
+    REQUIRE(angleCorr.getBloodVesselsSmoothed() == 0);
+    REQUIRE(angleCorr.getBloodVesselsIntersected() == nBloodVessels);
+    compareWithColdRun(angleCorr, true);
+}
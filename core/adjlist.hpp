@@ -1,74 +1,94 @@
 #ifndef ADJLIST_H
 #define ADJLIST_H
 
+#include <cassert>
 #include <vector>
 #include <iostream>
 using namespace std;
 
-/** 
- * Class representing an adjacency list, with the possibility of marking a node as visited
+/**
+ * Class representing an adjacency list, with the possibility of marking a node as visited.
+ * The neighbours are stored in compressed sparse row form: the neighbours of node i are
+ * m_neighbours[m_offsets[i]] ... m_neighbours[m_offsets[i+1]-1], in the order the edges were given.
  */
 class AdjList {
 private:
-  /// Adjacency list
-  vector<vector<int> > m_nodes;
+  /// Start of the neighbours of each node in m_neighbours, and the total number at the end
+  vector<int> m_offsets;
+  /// The neighbours of all nodes
+  vector<int> m_neighbours;
   /// Visited vector
-  vector<bool> m_visited;
-  typedef vector<vector<int> >::iterator nodeiter;
-  typedef vector<bool>::iterator visititer;
+  vector<char> m_visited;
 
-public: 
+public:
 
   /**
    * Constructor.
-   * Initialize an adjacency list and initialize all nodes to unvisited with no neighbours
+   * Build the adjacency list of an undirected graph in two passes over the edges,
+   * counting the neighbours of each node and then filling them in.
+   * All nodes are unvisited.
    * @param nodes Number of nodes in graph
+   * @param edges The edges, as pairs of nodes: edges[2*e] and edges[2*e+1] are adjacent
    */
-  AdjList(int nodes):m_nodes(nodes),  m_visited(nodes)
+  AdjList(int nodes, const vector<int>& edges):m_offsets(nodes+1, 0), m_neighbours(edges.size()), m_visited(nodes, 0)
   {
-    for(visititer i = m_visited.begin(); i != m_visited.end();++i)
+    assert(edges.size() % 2 == 0);
+    for(size_t e = 0; e < edges.size(); e++)
     {
-      *i = false;
+      m_offsets[edges[e]+1]++;
     }
-    for(nodeiter i = m_nodes.begin(); i != m_nodes.end(); ++i)
+    for(int i = 0; i < nodes; i++)
     {
-      (*i) = vector<int>();
+      m_offsets[i+1] += m_offsets[i];
     }
+    vector<int> next(m_offsets.begin(), m_offsets.end()-1);
+    for(size_t e = 0; e < edges.size(); e += 2)
+    {
+      m_neighbours[next[edges[e]]++] = edges[e+1];
+      m_neighbours[next[edges[e+1]]++] = edges[e];
+    }
+  }
+
+  /**
+   * @return the number of nodes in the graph
+   */
+  inline int
+  size() const
+  {
+    return (int)m_visited.size();
   }
 
   /**
-   * Mark two nodes as adjacent to each other (undirected)
-   * @param n1 Node 1
-   * @param n2 Node 2
+   * @param node Node
+   * @return the number of neighbours of the node
    */
-  inline void 
-  adjacent(int n1, int n2)
+  inline int
+  degree(int node) const
   {
-    m_nodes[n1].push_back(n2);
-    m_nodes[n2].push_back(n1);
+    return m_offsets[node+1] - m_offsets[node];
   }
 
   /**
    * Mark a node as visited
-   * @param node Node to mark as visited 
+   * @param node Node to mark as visited
    */
-  inline void 
+  inline void
   visit(int node)
   {
-    m_visited[node] = true;
+    m_visited[node] = 1;
   }
-  
+
   /**
    * Check if node is visited
    * @param node node to check if visited
    * @return true if node is visited
    */
-  inline 
+  inline
   bool isVisited(int node) const
   {
-    return m_visited[node];
+    return m_visited[node] != 0;
   }
-  
+
   /**
    * Find an adjacent node that has not been visited or found yet
    * @param node Node to find unvisited adjacent node for
@@ -76,34 +96,35 @@ public:
    */
   int findNext(int node) const
   {
-    for(unsigned int i = 0; i < m_nodes[node].size(); i++)
+    for(int i = m_offsets[node]; i < m_offsets[node+1]; i++)
     {
-      if(!m_visited[m_nodes[node][i]])
+      if(!m_visited[m_neighbours[i]])
       {
-	return m_nodes[node][i];
+	return m_neighbours[i];
       }
     }
     return -1;
   }
-  
-  /** 
+
+  /**
    * Find all adjacent nodes that has not been visited yet
    * @param node to find all unvisited adjacent nodes for
-   * @return vector of adjacent unvisited nodes, empty vector if no such nodes exists.
+   * @param next The unvisited adjacent nodes are appended here, in the order of the edges.
+   *        Reusing the same vector for all nodes avoids allocating one per node.
+   * @return the number of nodes appended
    */
-  vector<int> findAllNext(int node) const
+  int findAllNext(int node, vector<int>& next) const
   {
-    vector<int> ret = vector<int>();
-
-    for(unsigned int i = 0; i < m_nodes[node].size(); i++)
+    int found = 0;
+    for(int i = m_offsets[node]; i < m_offsets[node+1]; i++)
     {
-      if(!m_visited[m_nodes[node][i]] )
+      if(!m_visited[m_neighbours[i]] )
       {
-	ret.push_back(m_nodes[node][i]);
+	next.push_back(m_neighbours[i]);
+	found++;
       }
     }
-    return ret;
-    
+    return found;
   }
 
   /**
@@ -112,9 +133,9 @@ public:
    */
   int findFirst() const
   {
-    for(unsigned int i = 0; i < m_nodes.size(); i++)
+    for(int i = 0; i < size(); i++)
     {
-      if(m_nodes[i].size() == 1) 
+      if(degree(i) == 1)
       {
 	return i;
       }
@@ -129,27 +150,27 @@ public:
   vector<int> findAllFirst() const
   {
     vector<int> ret;
-    for(unsigned int i = 0; i < m_nodes.size(); i++)
+    for(int i = 0; i < size(); i++)
     {
-      if(m_nodes[i].size() == 1)
+      if(degree(i) == 1)
       {
 	ret.push_back(i);
       }
     }
     return ret;
   }
-	  
+
   /**
    * Print the adjacency list
    */
   void print()
   {
-    for(unsigned int i = 0; i < m_nodes.size(); i++)
+    for(int i = 0; i < size(); i++)
     {
       cerr << " Node " << i << ":\t";
-      for(unsigned int j = 0; j < m_nodes[i].size(); j++)
+      for(int j = m_offsets[i]; j < m_offsets[i+1]; j++)
       {
-	cerr << m_nodes[i][j] << " "; 
+	cerr << m_neighbours[j] << " ";
       }
       cerr << endl;
     }
@@ -0,0 +1,143 @@
+#ifndef CALCULATION_PROGRESS_HPP
+#define CALCULATION_PROGRESS_HPP
+
+#include <atomic>
+#include <functional>
+#include <stdexcept>
+
+/**
+ * Thrown from inside a calculation when it has been cancelled
+ */
+class CalculationCancelled : public std::runtime_error
+{
+public:
+    CalculationCancelled() : std::runtime_error("Calculation cancelled") {}
+};
+
+
+/**
+ * Progress of a running calculation, and the request to cancel it.
+ * The counters are lock-free atomics, updated by the worker threads and
+ * safe to read from any thread while the calculation runs.
+ * The totals become known as the pipeline proceeds, so getTotal() grows during a run.
+ */
+class CalculationProgress
+{
+public:
+    /// Called with getDone() and getTotal() when a counter changes
+    typedef std::function<void(int done, int total)> Callback;
+
+    CalculationProgress()
+    {
+        reset();
+    }
+
+    /**
+   * Zero all counters and clear any cancel request
+   */
+    void
+    reset()
+    {
+        restart();
+        m_cancel = false;
+    }
+
+    /**
+   * Zero all counters, keeping a cancel request made before the calculation started
+   */
+    void
+    restart()
+    {
+        framesLoaded = 0;
+        splinesTotal = 0;
+        splinesFitted = 0;
+        intersectionsTotal = 0;
+        intersectionsGrown = 0;
+    }
+
+    /**
+   * Set the function called when a counter changes through add().
+   * It is called from the worker threads, possibly several at a time, and must be thread safe.
+   * @param callback The function, or an empty one for none
+   */
+    void
+    setCallback(const Callback& callback)
+    {
+        m_callback = callback;
+    }
+
+    /**
+   * Add to a counter of this and report the progress to the callback, see setCallback()
+   * @param counter One of the counters
+   * @param n The amount to add
+   */
+    void
+    add(std::atomic<int>& counter, int n = 1)
+    {
+        counter += n;
+        if(m_callback) m_callback(getDone(), getTotal());
+    }
+
+    /**
+   * Ask the calculation to stop as soon as possible
+   */
+    void
+    cancel()
+    {
+        m_cancel = true;
+    }
+
+    /**
+   * @return true if cancel() has been called since the last reset()
+   */
+    bool
+    isCancelled() const
+    {
+        return m_cancel;
+    }
+
+    /**
+   * Throw CalculationCancelled if the calculation has been cancelled.
+   * Called from the hot loops of the calculation.
+   */
+    void
+    checkCancelled() const
+    {
+        if(m_cancel) throw CalculationCancelled();
+    }
+
+    /**
+   * @return number of work items done so far
+   */
+    int
+    getDone() const
+    {
+        return framesLoaded + splinesFitted + intersectionsGrown;
+    }
+
+    /**
+   * @return number of work items known so far
+   */
+    int
+    getTotal() const
+    {
+        return framesLoaded + splinesTotal + intersectionsTotal;
+    }
+
+    /// Number of velocity frames read from disk
+    std::atomic<int> framesLoaded;
+    /// Number of splines to fit
+    std::atomic<int> splinesTotal;
+    /// Number of splines fitted
+    std::atomic<int> splinesFitted;
+    /// Number of intersections to region grow
+    std::atomic<int> intersectionsTotal;
+    /// Number of intersections region grown
+    std::atomic<int> intersectionsGrown;
+
+private:
+    std::atomic<bool> m_cancel;
+    Callback m_callback;
+};
+
+#endif // CALCULATION_PROGRESS_HPP
@@ -0,0 +1,104 @@
+#ifndef CENTERLINE_HASH_HPP
+#define CENTERLINE_HASH_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vtkSmartPointer.h>
+#include <vtkPolyData.h>
+#include <vtkPoints.h>
+#include <vtkCellArray.h>
+#include <vtkDataArray.h>
+
+/// Start value of hashBytes()
+const uint64_t HASH_SEED = 14695981039346656037ULL;
+
+namespace hash_detail
+{
+/// Multiply and fold the high bits down, so every input bit affects every output bit
+inline uint64_t
+mix(uint64_t x)
+{
+    x *= 0x9E3779B97F4A7C15ULL;
+    return x ^ (x >> 29);
+}
+}
+
+/**
+ * Continue a 64 bit hash with a block of memory.
+ * Reads 8 bytes at a time into four independent lanes, so large blocks hash at
+ * memory speed. Meant for detecting changed data, not for security.
+ * @param hash The hash so far, HASH_SEED to start a new hash
+ * @param data The memory to hash
+ * @param bytes Number of bytes
+ * @return the hash including the block
+ */
+inline uint64_t
+hashBytes(uint64_t hash, const void* data, size_t bytes)
+{
+    using hash_detail::mix;
+    const unsigned char* p = static_cast<const unsigned char*>(data);
+    uint64_t lanes[4] = {hash, hash ^ 1, hash ^ 2, hash ^ 3};
+    size_t i = 0;
+    for(; i + sizeof(lanes) <= bytes; i += sizeof(lanes))
+    {
+        for(int k = 0; k < 4; k++)
+        {
+            uint64_t word;
+            std::memcpy(&word, p + i + k*sizeof(word), sizeof(word));
+            lanes[k] = mix(lanes[k] ^ word);
+        }
+    }
+    for(; i < bytes; i++)
+    {
+        lanes[0] = mix(lanes[0] ^ p[i]);
+    }
+    uint64_t result = mix(lanes[0] ^ bytes);
+    for(int k = 1; k < 4; k++)
+    {
+        result = mix(result ^ lanes[k]);
+    }
+    return result;
+}
+
+/**
+ * Continue a hash with the type, size and raw values of a VTK array
+ * @param hash The hash so far
+ * @param array The array, may be NULL
+ * @return the hash including the array
+ */
+inline uint64_t
+hashArray(uint64_t hash, vtkDataArray* array)
+{
+    const int64_t header[2] = {array ? array->GetDataType() : -1,
+                               array ? (int64_t)array->GetNumberOfTuples()*array->GetNumberOfComponents() : 0};
+    hash = hashBytes(hash, header, sizeof(header));
+    if(!array || header[1] == 0) return hash;
+    return hashBytes(hash, array->GetVoidPointer(0), header[1]*array->GetDataTypeSize());
+}
+
+/**
+ * Hash the content of a centerline: the point coordinates and the lines connecting them.
+ * Works on the raw arrays of the polydata, without copying or visiting the points one by one.
+ * Centerlines with the same hash are taken to be the same.
+ * @param data The centerline
+ * @return the hash
+ */
+inline uint64_t
+hashCenterline(vtkSmartPointer<vtkPolyData> data)
+{
+    vtkPoints *points = data->GetPoints();
+    uint64_t hash = hashArray(HASH_SEED, points ? points->GetData() : NULL);
+
+    vtkCellArray *lines = data->GetLines();
+    if(!lines) return hash;
+#if VTK_MAJOR_VERSION >= 9
+    hash = hashArray(hash, lines->GetOffsetsArray());
+    return hashArray(hash, lines->GetConnectivityArray());
+#else
+    // The legacy layout, the number of points of each line followed by the point ids
+    return hashArray(hash, lines->GetData());
+#endif
+}
+
+#endif // CENTERLINE_HASH_HPP
@@ -0,0 +1,114 @@
+#ifndef FRAME_GEOMETRY_HPP
+#define FRAME_GEOMETRY_HPP
+
+#include <cmath>
+#include "plane3d.hpp"
+#include "matrix.hpp"
+
+/**
+ * The geometry of a frame, derived once from its transform and pixel spacing.
+ *
+ * Holds what the per-intersection code needs in the form it needs it: the plane
+ * equation of the image, the image axes in world coordinates normalized to unit
+ * length, and the affine map from world coordinates to pixel coordinates with the
+ * inverse transform and the pixel spacing folded in.
+ * A plain record of doubles, so the records of many frames can be stored contiguously,
+ * see PlaneBatch.
+ */
+struct FrameGeometry
+{
+    /**
+   * Constructor. Initialize everything to zero
+   */
+    FrameGeometry()
+    {
+        for(int i = 0; i < 4; i++)
+        {
+            plane[i] = 0.0;
+            toPixel[0][i] = 0.0;
+            toPixel[1][i] = 0.0;
+        }
+        for(int j = 0; j < 3; j++)
+        {
+            for(int i = 0; i < 3; i++)
+            {
+                axes[j][i] = 0.0;
+            }
+        }
+    }
+
+    /**
+   * Constructor. Derive the geometry of a frame
+   * @param transform The image to world transform of the frame, see MetaImage::getTransform()
+   * @param xspacing The pixel spacing in x direction
+   * @param yspacing The pixel spacing in y direction
+   */
+    FrameGeometry(const Matrix4& transform, double xspacing, double yspacing)
+    {
+        // Same coefficients as Plane3D(const Eigen::Matrix4d)
+        plane[3] = 0.0;
+        for(int i = 0; i < 3; i++)
+        {
+            plane[i] = transform(i,2);
+            plane[3] -= plane[i]*transform(i,3);
+        }
+
+        for(int j = 0; j < 3; j++)
+        {
+            double length = 0.0;
+            for(int i = 0; i < 3; i++)
+            {
+                length += transform(i,j)*transform(i,j);
+            }
+            length = std::sqrt(length);
+            for(int i = 0; i < 3; i++)
+            {
+                axes[j][i] = length > 0.0 ? transform(i,j)/length : 0.0;
+            }
+        }
+
+        // The transform maps image to world, so world to image is p = R^T p - R^T p_0
+        const double spacing[2] = {xspacing, yspacing};
+        for(int j = 0; j < 2; j++)
+        {
+            toPixel[j][3] = 0.0;
+            for(int i = 0; i < 3; i++)
+            {
+                toPixel[j][i] = transform(i,j)/spacing[j];
+                toPixel[j][3] -= transform(i,j)*transform(i,3);
+            }
+            toPixel[j][3] /= spacing[j];
+        }
+    }
+
+    /**
+   * @return the plane of the image
+   */
+    Plane3D
+    getPlane() const
+    {
+        return Plane3D(plane);
+    }
+
+    /**
+   * Transform a point from world coordinates to pixel coordinates
+   * @param x The x coordinate is returned here
+   * @param y The y coordinate is returned here
+   * @param p The point to transform
+   */
+    inline void
+    toImgCoords(double &x, double &y, const double p[3]) const
+    {
+        x = toPixel[0][0]*p[0] + toPixel[0][1]*p[1] + toPixel[0][2]*p[2] + toPixel[0][3];
+        y = toPixel[1][0]*p[0] + toPixel[1][1]*p[1] + toPixel[1][2]*p[2] + toPixel[1][3];
+    }
+
+    /// The plane equation coefficients a,b,c,d, see Plane3D
+    double plane[4];
+    /// axes[j] is image axis j in world coordinates, of unit length
+    double axes[3][3];
+    /// Rows mapping a world point (x,y,z,1) to pixel x and pixel y
+    double toPixel[2][4];
+};
+
+#endif // FRAME_GEOMETRY_HPP
@@ -0,0 +1,160 @@
+#ifndef FRAME_STORE_HPP
+#define FRAME_STORE_HPP
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "metaimage.hpp"
+#include "plane_batch.hpp"
+#include "calculation_progress.hpp"
+
+/**
+ * An immutable set of velocity frames read from disk.
+ *
+ * A FrameStore is only handed out as a shared pointer to const, so it can be shared
+ * by any number of AngleCorrection instances, on any number of threads, without
+ * copying the frames. It lives as long as somebody refers to it.
+ * The geometry of the frames is derived once, when they are read, see getPlanes().
+ *
+ * Thread safety: all const member functions of FrameStore and MetaImage, including
+ * MetaImage::regionGrow(), MetaImage::toImgCoords() and MetaImage::inImage(), only
+ * read the frames and may be called concurrently from any number of threads.
+ */
+class FrameStore
+{
+public:
+    typedef MetaImage<inData_t> Frame;
+    typedef std::shared_ptr<const FrameStore> Ptr;
+
+    /**
+   * Get the frames with the given prefix.
+   * If the frames are already held by someone else in this process they are shared,
+   * otherwise they are read from disk.
+   * @param prefix The prefix of the file names, see MetaImage::readImages()
+   * @param progress If given, counts the frames read and is checked for cancellation
+   * @return the frames
+   */
+    static Ptr
+    load(const std::string& prefix, CalculationProgress* progress = NULL)
+    {
+        Ptr frames = lookup(prefix);
+        if(frames) return frames;
+
+        // Read without holding the lock, so other prefixes can be loaded meanwhile
+        std::unique_ptr<vector<Frame> > images(Frame::readImages(prefix, progress));
+        frames = Ptr(new FrameStore(prefix, *images));
+
+        std::lock_guard<std::mutex> lock(cacheMutex());
+        Ptr existing = cache()[prefix].lock();
+        if(existing) return existing;
+        cache()[prefix] = frames;
+        return frames;
+    }
+
+    /**
+   * Get the frames with the given prefix, if they are already loaded
+   * @param prefix The prefix of the file names
+   * @return the shared frames, or an empty pointer
+   */
+    static Ptr
+    lookup(const std::string& prefix)
+    {
+        std::lock_guard<std::mutex> lock(cacheMutex());
+        auto it = cache().find(prefix);
+        if(it == cache().end()) return Ptr();
+        Ptr frames = it->second.lock();
+        if(!frames) cache().erase(it);
+        return frames;
+    }
+
+    /**
+   * @return the prefix the frames were read from
+   */
+    const std::string&
+    getPrefix() const
+    {
+        return m_prefix;
+    }
+
+    /**
+   * @return the frames, ordered by index
+   */
+    const vector<Frame>&
+    getFrames() const
+    {
+        return m_frames;
+    }
+
+    /**
+   * @return the image planes and geometry of the frames, packed for batched intersection
+   *         of splines of type Spline3D<T>, T is double or float
+   */
+    template<typename T = double>
+    const PlaneBatch<T>&
+    getPlanes() const;
+
+    /**
+   * @return the number of frames
+   */
+    size_t
+    size() const
+    {
+        return m_frames.size();
+    }
+
+    /**
+   * @param i Frame index
+   * @return frame number i
+   */
+    const Frame&
+    operator[](size_t i) const
+    {
+        return m_frames[i];
+    }
+
+private:
+    FrameStore(const std::string& prefix, vector<Frame>& frames) :
+        m_prefix(prefix), m_planes(frames), m_planesFloat(frames)
+    {
+        m_frames.swap(frames);
+    }
+    FrameStore(const FrameStore&);
+    FrameStore& operator=(const FrameStore&);
+
+    static std::mutex&
+    cacheMutex()
+    {
+        static std::mutex mutex;
+        return mutex;
+    }
+
+    static std::map<std::string, std::weak_ptr<const FrameStore> >&
+    cache()
+    {
+        static std::map<std::string, std::weak_ptr<const FrameStore> > frames;
+        return frames;
+    }
+
+    std::string m_prefix;
+    vector<Frame> m_frames;
+    PlaneBatch<double> m_planes;
+    PlaneBatch<float> m_planesFloat;
+};
+
+template<>
+inline const PlaneBatch<double>&
+FrameStore::getPlanes<double>() const
+{
+    return m_planes;
+}
+
+template<>
+inline const PlaneBatch<float>&
+FrameStore::getPlanes<float>() const
+{
+    return m_planesFloat;
+}
+
+#endif // FRAME_STORE_HPP
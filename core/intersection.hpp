@@ -6,6 +6,8 @@
 #include <numeric>
 #include "spline3d.hpp"
 #include "metaimage.hpp"
+#include "precision.hpp"
+#include "simd_dispatch.hpp"
 
 template<typename T>
 class Spline3D;
@@ -21,7 +23,7 @@ public:
   /**
    * Initialize everything to 0, false or NULL
    */
-  Intersection():m_points()
+  Intersection()
   {
     m_spline = NULL;
     m_intersection_pos = 0.0;
@@ -29,8 +31,8 @@ public:
     m_origAvgValue = 0.0;
     m_valid = false;
     m_img = NULL;
-    m_avg_computed = 0;
     m_avgValue = 0;
+    m_stats = RegionStatistics();
   }      
   /**
    * Retrieve the intersecting spline curve 
@@ -94,45 +96,53 @@ public:
   }
 
   /**
-   * Set the points associated with this intersection (i.e. the region-grown points)
+   * Set the points associated with this intersection (i.e. the region-grown points).
+   * Only their statistics are kept, see getStatistics()
    * @param points the points
    */
   inline void
   setPoints(const vector<T>& points)
   {
-    m_points = points;
-    m_avg_computed = false;
+    __computeStatistics(points);
+    m_origAvgValue = m_avgValue;
   }
- 
+
   /**
-   * Set the points associated with this intersection (i.e. the region-grown points)
-   * @param points the points
+   * Get the statistics of the points, computed when the points were set or grown
+   * @return the statistics
    */
-  inline void
-  setPoints(vector<T>&& points)
+  inline const RegionStatistics&
+  getStatistics() const
+  {
+    return m_stats;
+  }
+
+  /**
+   * Get the number of region grown points
+   * @return the number of points
+   */
+  inline int
+  getNumberOfPoints() const
   {
-    m_points = std::move(points);
-    m_avg_computed = false;
+    return (int)m_stats.count;
   }
 
   /**
-   * Set the points associated with this intersection (i.e. the region-grown points)
-   * @return  the points
+   * Get the number of region grown points with a positive value
+   * @return the number of positive points, the others are zero or negative
    */
-  inline vector<T>& 
-  getPoints()
+  inline int
+  getPositiveCount() const
   {
-    return m_points;
+    return (int)m_stats.positive;
   }
 
   /**
    * Get the (cached) average of the region growed points
    */
   inline T 
-  getAverage()
+  getAverage() const
   {
-    if(!m_avg_computed)
-      __computeAverage();
     return m_avgValue;
   }
 
@@ -174,7 +184,6 @@ public:
   setMetaImage(const MetaImage<inData_t>* img)
   {
     m_img = img;
-    m_avg_computed = false;
   }
   
   /**
@@ -195,44 +204,43 @@ public:
    * @return average value before the aliasing correction
    */
   inline T 
-  getOrigAvgValue()
+  getOrigAvgValue() const
   {
     return m_origAvgValue;
   }
   
   /**
-   * Perform aliasing correction on the image data of this intersection
+   * Perform aliasing correction on the image data of this intersection.
+   * The points on the wrong side of zero for the flow direction are assumed to be
+   * aliased by 2*Vnyq, so the corrected average follows from the statistics of the
+   * points alone. Always starts from the uncorrected average, running it again
+   * with other parameters replaces the previous correction.
    * @param direction Direction (relative to parameter of spline) the blood is assumed to flow
    * @param Vnyq the nyquist velocity
    */
   inline void 
   correctAliasing(T direction,T Vnyq)
   {
-
-    m_avgValue = 0.0;
-    for(auto it = m_points.begin(); it != m_points.end(); it++)
+    if (m_stats.count==0){
+      m_avgValue =0.0;
+      m_valid = false;
+      return;
+    }
+    bool sign = sgn(direction) == sgn(m_cosTheta);
+    double sum = m_stats.sum;
+    if(sign)
     {
-      bool sign = sgn(direction) == sgn(m_cosTheta);
-      if(*it < 0 && sign)
-      {
-    	  *it += 2*Vnyq;
-      }
-      else if(*it > 0 && !sign)
-      {
-    	  *it -= 2*Vnyq;
-      }
-      m_avgValue += *it;
+      sum += 2.0*Vnyq*m_stats.negative;
     }
-    if (m_points.size()==0){
-    	m_avgValue =0.0;
-    	m_valid = false;
-    }else{
-    	m_avgValue = m_avgValue/m_points.size();
+    else
+    {
+      sum -= 2.0*Vnyq*m_stats.positive;
     }
+    m_avgValue = sum/m_stats.count;
   }
  
   /**
-   * Compute the sample weight for the image in this intersection
+   * Compute the sample weight for the image in this intersection, from the cached statistics
    * @param A The factor with which to multiply the sample weighting function
    * @param a lower abs(cosTheta) cutoff
    * @param b upper abs(cosTheta) cutoff
@@ -241,13 +249,8 @@ public:
   inline T 
   sampleWeight(const T A, const T a, const T b) const
   {
-    int positive;
-    int negative;
-    positive = std::accumulate(m_points.begin(), m_points.end(), 0, 
-			       [](int k, T l){ if(l > 0) return k + 1; return k; }
-      );
-
-    negative = m_points.size()-positive;
+    int positive = getPositiveCount();
+    int negative = getNumberOfPoints()-positive;
   
     T pos_weight = (T)(positive - negative)/(double)(positive + negative);
     pos_weight = pos_weight * pos_weight;
@@ -275,36 +278,41 @@ public:
   }
       
   /**
-   * Region grow the meta image
+   * Region grow the meta image. Replaces any previously grown points.
    */
   inline void 
   regionGrow()
   {
     if(!isValid()) return;
+    // Only the statistics of the points are kept, so grow into a buffer reused by the thread
+    static thread_local vector<T> points;
+    points.clear();
     T p[3];
     evaluate(p);
-    T img_x, img_y;
-    m_img->toImgCoords(img_x, img_y, p);
+    const double world[3] = {p[0], p[1], p[2]};
+    double img_x, img_y;
+    m_img->toImgCoords(img_x, img_y, world);
     if(m_img->inImage(img_x, img_y))
     {
-      m_img->regionGrow(m_points,(int)img_x, (int)img_y);
+      m_img->regionGrow(points,(int)img_x, (int)img_y);
     }
+    __computeStatistics(points);
+    m_origAvgValue = m_avgValue;
   }
 
 
 private:
-  void __computeAverage()
+  /**
+   * Compute all statistics of the points in one pass, see simdRegionStatistics()
+   */
+  void __computeStatistics(const vector<T>& points)
     {
-      m_avgValue = std::accumulate(m_points.begin(), m_points.end(), 0.0, plus<T>());
-      //m_avgValue = m_avgValue/(T)m_points.size();
-      m_origAvgValue = m_avgValue;
-      m_avg_computed = true;
-
-      if (m_points.size()==0){
+      m_stats = simdRegionStatistics(points.data(), points.size());
+      if (m_stats.count==0){
       	m_avgValue =0.0;
       	m_valid = false;
       }else{
-    	  m_avgValue = m_avgValue/(T)m_points.size();
+    	  m_avgValue = m_stats.sum/(T)m_stats.count;
       }
     }
   
@@ -313,9 +321,8 @@ private:
   T m_cosTheta;
   T m_avgValue;
   const MetaImage<inData_t> *m_img;
-  vector<T> m_points;
+  RegionStatistics m_stats;
   bool m_valid;
-  bool m_avg_computed;
   T m_origAvgValue;
 };
   
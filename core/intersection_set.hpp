@@ -1,18 +1,30 @@
 #ifndef INTERSECTION_SET_HPP
 #define INTERSECTION_SET_HPP
 #include "intersection.hpp"
+#include "precision.hpp"
+#include "reduction.hpp"
 
+#include <cmath>
+#include <utility>
 #include <vector>
 
 /**
  * Represents a set of intersections.
  * Typically, an instance of this object will only contain intersections with the same spline.
  * Implements the algorithms relevant for multiple instersections.
+ *
+ * The estimators work on contiguous copies of the values they need, see updateStatistics().
+ * The vector members that can change the intersections are therefore hidden by versions
+ * that mark the copies out of date, so they are refreshed by the next estimate.
  */
 template<typename T>
 class IntersectionSet : public std::vector<Intersection<T> >
 {
+  typedef std::vector<Intersection<T> > Base;
+
 public:
+  typedef typename Base::iterator iterator;
+  typedef typename Base::const_iterator const_iterator;
 
   /**
    * Initialize everything to zero except the algorithm parameters:
@@ -24,6 +36,7 @@ public:
    */
   IntersectionSet()
   {
+    m_statistics_stale = true;
     m_direction = 0.0;
     m_have_direction = false;
     m_have_velocity_ls = false;
@@ -34,43 +47,109 @@ public:
     m_vel_a = 0.17;
     m_vel_b = 1.0;
   }
-public:
+
+  /**
+   * The mutable element access of std::vector, marking the statistics out of date
+   */
+  Intersection<T>& operator[](size_t k) { m_statistics_stale = true; return Base::operator[](k); }
+  const Intersection<T>& operator[](size_t k) const { return Base::operator[](k); }
+  Intersection<T>& at(size_t k) { m_statistics_stale = true; return Base::at(k); }
+  const Intersection<T>& at(size_t k) const { return Base::at(k); }
+  Intersection<T>& front() { m_statistics_stale = true; return Base::front(); }
+  const Intersection<T>& front() const { return Base::front(); }
+  Intersection<T>& back() { m_statistics_stale = true; return Base::back(); }
+  const Intersection<T>& back() const { return Base::back(); }
+  Intersection<T>* data() { m_statistics_stale = true; return Base::data(); }
+  const Intersection<T>* data() const { return Base::data(); }
+  iterator begin() { m_statistics_stale = true; return Base::begin(); }
+  const_iterator begin() const { return Base::begin(); }
+  iterator end() { m_statistics_stale = true; return Base::end(); }
+  const_iterator end() const { return Base::end(); }
+
+  /**
+   * The modifiers of std::vector, marking the statistics out of date
+   */
+  void push_back(const Intersection<T>& intersection) { m_statistics_stale = true; Base::push_back(intersection); }
+  void push_back(Intersection<T>&& intersection) { m_statistics_stale = true; Base::push_back(std::move(intersection)); }
+  template<typename... Args>
+  void emplace_back(Args&&... args) { m_statistics_stale = true; Base::emplace_back(std::forward<Args>(args)...); }
+  template<typename... Args>
+  iterator insert(Args&&... args) { m_statistics_stale = true; return Base::insert(std::forward<Args>(args)...); }
+  template<typename... Args>
+  iterator erase(Args&&... args) { m_statistics_stale = true; return Base::erase(std::forward<Args>(args)...); }
+  template<typename... Args>
+  void assign(Args&&... args) { m_statistics_stale = true; Base::assign(std::forward<Args>(args)...); }
+  template<typename... Args>
+  void resize(Args&&... args) { m_statistics_stale = true; Base::resize(std::forward<Args>(args)...); }
+  void pop_back() { m_statistics_stale = true; Base::pop_back(); }
+  void clear() { m_statistics_stale = true; Base::clear(); }
+
+  /**
+   * Copy the per-intersection values the estimators need (cosTheta, average before
+   * and after aliasing correction, positive and non-positive point counts and validity)
+   * into contiguous arrays.
+   * Done automatically by the estimators after the set was changed through its own
+   * members. Call it again after changing the intersections through a reference or
+   * iterator taken before the last update, like when region growing them in parallel.
+   */
+  void
+  updateStatistics()
+  {
+    const size_t n = this->size();
+    m_cosTheta.resize(n);
+    m_average.resize(n);
+    m_corrected.resize(n);
+    m_positive.resize(n);
+    m_nonPositive.resize(n);
+    m_valid.resize(n);
+    for(size_t k = 0; k < n; k++)
+    {
+      const Intersection<T> &i = Base::operator[](k);
+      m_average[k] = i.getOrigAvgValue();
+      m_corrected[k] = i.getAverage();
+      m_cosTheta[k] = i.getCosTheta();
+      m_positive[k] = i.getPositiveCount();
+      m_nonPositive[k] = i.getNumberOfPoints() - m_positive[k];
+      m_valid[k] = i.isValid() && i.getNumberOfPoints() > 0;
+    }
+    m_statistics_stale = false;
+  }
+
   /**
    * Estimate the flow direction, assuming all intersections belong to the same curve
    * Parameters can be set with setDirectionEstimationParameters()
+   * The terms are computed without branches over the arrays of updateStatistics(),
+   * and summed with deterministicReduce()
    */
   void 
   estimateDirection()
   {
-    std::pair<T,T> vel_weight;
-    struct 
+    typedef typename AccumulatorType<T>::Type Acc;
+    if(m_statistics_stale)
+      updateStatistics();
+
+    const size_t n = this->size();
+    const T A = m_dir_A;
+    const T a = m_dir_a;
+    const T b = m_dir_b;
+    m_numerator.resize(n);
+    m_denominator.resize(n);
+    for(size_t k = 0; k < n; k++)
     {
-      T A;
-      T a;
-      T b;
-      std::pair<T,T>& operator()(std::pair<T,T>& ret, Intersection<T>& i)
-      {
-	   
-		T weight = i.sampleWeight(A, a,b);
-		T tmp = i.getAverage()*i.getCosTheta();
-		tmp = weight*tmp/abs(tmp);
-
-		if(!std::isnan(tmp))
-		{
-		  ret.first += tmp;
-		  ret.second += weight;
-
-		}
-		return ret;
-
-	  }
-    } weight_accum;
-    
-    weight_accum.a = m_dir_a;
-    weight_accum.b = m_dir_b;
-    weight_accum.A = m_dir_A;
-    vel_weight = std::accumulate(this->begin(), this->end(), std::make_pair(0.0, 0.0),
-				 weight_accum);
+      // Intersections without points, or with a zero or NaN average, have no direction
+      const T tmp = m_average[k]*m_cosTheta[k];
+      const T absCosTheta = std::abs(m_cosTheta[k]);
+      const bool use = m_valid[k] && std::abs(tmp) > 0;
+      const int total = use ? m_positive[k] + m_nonPositive[k] : 1;
+      T pos_weight = (T)(m_positive[k] - m_nonPositive[k])/(double)total;
+      pos_weight = pos_weight * pos_weight;
+      const T weight = A*pos_weight + ((absCosTheta > a && absCosTheta < b) ? T(1) : T(0));
+      const T sign = tmp > 0 ? T(1) : T(-1);
+      m_numerator[k] = use ? Acc(weight*sign) : Acc(0);
+      m_denominator[k] = use ? Acc(weight) : Acc(0);
+    }
+
+    const std::pair<Acc,Acc> vel_weight = sumTerms();
     m_direction = vel_weight.first/vel_weight.second;
     m_have_direction = true;
     if(std::isnan(m_direction))
@@ -82,39 +161,32 @@ public:
   /**
    * Perform least-squares velocity estimation
    * Parameters can be set with setVelocityEstimationCutoff
+   * The terms are computed without branches over the arrays of updateStatistics(),
+   * and summed with deterministicReduce()
    */
   void 
   estimateVelocityLS()
   {
-    std::pair<T,T> top_bottom;
-      
-    struct
+    typedef typename AccumulatorType<T>::Type Acc;
+    if(m_statistics_stale)
+      updateStatistics();
+
+    const size_t n = this->size();
+    const T a = m_vel_a;
+    const T b = m_vel_b;
+    m_numerator.resize(n);
+    m_denominator.resize(n);
+    for(size_t k = 0; k < n; k++)
     {
-      T a;
-      T b;
-      std::pair<T,T>& operator()(std::pair<T,T> &ret, Intersection<T> &i)
-      {
-        if(abs(i.getCosTheta()) < a || abs(i.getCosTheta()) > b){
-		  return ret;
-        }
-		double tmp1, tmp2;
-
-		tmp1 = i.getAverage()*i.getCosTheta();
-		tmp2 = i.getCosTheta()*i.getCosTheta();
-		if(!std::isnan(tmp1) && !std::isnan(tmp2))
-		{
-		  ret.first += tmp1;
-		  ret.second += tmp2;
-		}
-		return ret;
-      }
-    } accum;
-	
-    accum.a = m_vel_a;
-    accum.b = m_vel_b;
-    top_bottom = std::accumulate(this->begin(), this->end(), 
-				 std::make_pair(0.0,0.0), accum);
-    m_velocity_ls = top_bottom.first/top_bottom.second;
+      // Also false for a NaN cosTheta or average
+      const T absCosTheta = std::abs(m_cosTheta[k]);
+      const bool use = absCosTheta >= a && absCosTheta <= b && m_corrected[k] == m_corrected[k];
+      m_numerator[k] = use ? Acc(m_corrected[k])*m_cosTheta[k] : Acc(0);
+      m_denominator[k] = use ? Acc(m_cosTheta[k])*m_cosTheta[k] : Acc(0);
+    }
+
+    const std::pair<Acc,Acc> vel_cos = sumTerms();
+    m_velocity_ls = vel_cos.first/vel_cos.second;
     m_have_velocity_ls = true;
 
     if(std::isnan(m_velocity_ls ))
@@ -130,9 +202,14 @@ public:
   void 
   correctAliasing(T Vnyq)
   {
-    for(auto &intersection : *this)
+    if(m_statistics_stale)
+      updateStatistics();
+    // The corrected averages are updated here, so the statistics stay up to date
+    for(size_t k = 0; k < this->size(); k++)
     {
+      Intersection<T> &intersection = Base::operator[](k);
       intersection.correctAliasing(m_direction,Vnyq);
+      m_corrected[k] = intersection.getAverage();
     }
   }
 
@@ -185,6 +262,19 @@ public:
   
 
 private:
+  /**
+   * Sum the estimator terms in m_numerator and m_denominator, in the same order for any number of threads
+   * @return the sums of the numerators and of the denominators
+   */
+  std::pair<typename AccumulatorType<T>::Type, typename AccumulatorType<T>::Type>
+  sumTerms() const
+  {
+    typedef typename AccumulatorType<T>::Type Acc;
+    return deterministicReduce(m_numerator.size(), std::make_pair(Acc(0), Acc(0)),
+                               [this](size_t k){ return std::make_pair(m_numerator[k], m_denominator[k]); },
+                               pairSum<Acc>);
+  }
+
   T m_direction;
   bool m_have_direction;
   bool m_have_velocity_ls;
@@ -192,7 +282,20 @@ private:
   T m_dir_a, m_dir_b;
   T m_vel_a, m_vel_b;
   T m_dir_A;
-  
+
+  // Per-intersection values, see updateStatistics()
+  bool m_statistics_stale;
+  std::vector<T> m_cosTheta;
+  // Average before and after aliasing correction, see correctAliasing()
+  std::vector<T> m_average;
+  std::vector<T> m_corrected;
+  // Points above zero, and the others, as in Intersection::sampleWeight()
+  std::vector<int> m_positive;
+  std::vector<int> m_nonPositive;
+  std::vector<char> m_valid;
+  // Per-intersection terms of the estimator sums
+  std::vector<typename AccumulatorType<T>::Type> m_numerator;
+  std::vector<typename AccumulatorType<T>::Type> m_denominator;
 };
 
 
@@ -5,11 +5,16 @@
 #include <vtkMetaImageReader.h>
 #include <vtkImageData.h>
 #include "ErrorHandler.hpp"
+#include "calculation_progress.hpp"
+#include "frame_geometry.hpp"
 
 /**
  * A class to represent a MetaImage. This includes reading it and
  * knowing its position in space.
  * Region growing is also done by this class
+ *
+ * The image is read-only once read from disk, and all const member functions
+ * may be called concurrently, see FrameStore.
  */
 template<typename T>
 class MetaImage {
@@ -26,6 +31,7 @@ public:
         m_yspacing = 0.0;
         m_transform = Matrix4::Zero();
         m_idx = -1;
+        m_pixels = NULL;
     }
 
     ~MetaImage()
@@ -77,22 +83,13 @@ public:
     }
 
 
-    /**
-   * @return the pointer to the pixel data
-   */
-    T*
-    getPixelPointer()
-    {
-        return (T*)m_img->GetScalarPointer();
-    }
-
     /**
    * @return the pointer to the pixel data
    */
     const T*
     getPixelPointer() const
     {
-        return (T*)m_img->GetScalarPointer();
+        return m_pixels;
     }
 
     /**
@@ -106,47 +103,17 @@ public:
                 double &y,
                 const double p[3]) const
     {
-
-
-        // Thing is, the matrices we are given are the opposite transform,
-        // so we have to do the inverse transformation: p = R^Tp - R^Tp_0
-        double offset_x, offset_y;
-        x =
-                m_transform(0,0)*p[0] +
-                m_transform(1,0)*p[1] +
-                m_transform(2,0)*p[2];
-        // Now subtract the transformed offset
-        offset_x =
-                m_transform(0,0)*m_transform(0,3) +
-                m_transform(1,0)*m_transform(1,3) +
-                m_transform(2,0)*m_transform(2,3);
-        x = (x - offset_x)/getXSpacing();
-        y =
-                m_transform(0,1)*p[0] +
-                m_transform(1,1)*p[1] +
-                m_transform(2,1)*p[2];
-        // Now subtract the transformed offset
-        offset_y =
-                m_transform(0,1)*m_transform(0,3) +
-                m_transform(1,1)*m_transform(1,3) +
-                m_transform(2,1)*m_transform(2,3);
-
-        y = (y - offset_y)/getYSpacing();
-
-
+        m_geometry.toImgCoords(x, y, p);
     }
 
-
-
     /**
-   * Get the transformation matrix for this image
-   * @return the transformation matrix
-   * @sa setTransform
+   * Get the geometry of this image, derived from the transform and the spacing when read
+   * @return the geometry
    */
-    Matrix4
-    getTransform()
+    const FrameGeometry&
+    getGeometry() const
     {
-        return m_transform;
+        return m_geometry;
     }
 
     /**
@@ -249,9 +216,10 @@ public:
     /**
    * Factory function to get a bunch of images by reading them from disk.
    * @param prefix The prefix of the file name. File names are assumed to be of the format prefix$NUMBER.mhd
+   * @param progress If given, counts the frames read and is checked for cancellation
    * @return a vector containing the retrieved images
    */
-    static vector<MetaImage>* readImages(const string & prefix)
+    static vector<MetaImage>* readImages(const string & prefix, CalculationProgress* progress = NULL)
     {
         // Images are on the format prefix$NUMBER.mhd
         vtkSmartPointer<vtkMetaImageReader> reader= vtkSmartPointer<vtkMetaImageReader>::New();
@@ -273,6 +241,11 @@ public:
         vector<MetaImage> *ret = new vector<MetaImage>();
         while(reader->CanReadFile(filename.c_str()))
         {
+            if(progress && progress->isCancelled())
+            {
+                delete ret;
+                throw CalculationCancelled();
+            }
             ret->push_back(MetaImage());
             ret->at(i).setIdx(i);
             ret->at(i).m_img->DeepCopy(reader->GetOutput());
@@ -281,6 +254,8 @@ public:
             ret->at(i).m_img->Update();
 #else
 #endif
+            // Looked up once here, as vtkImageData does not promise that the lookup is thread safe
+            ret->at(i).m_pixels = (const T*)ret->at(i).m_img->GetScalarPointer();
 
             if (errorObserver->GetError())
             {
@@ -343,6 +318,9 @@ public:
                     if(found >=numToFind) break;
                 }
             }
+            ret->at(i).m_geometry = FrameGeometry(ret->at(i).m_transform, ret->at(i).m_xspacing, ret->at(i).m_yspacing);
+            if(progress) progress->add(progress->framesLoaded);
+
             ss.clear();
             ss.str("");
             ss << prefix << ++i << ".mhd";
@@ -370,12 +348,14 @@ public:
 
 private:
     vtkSmartPointer<vtkImageData> m_img;
+    const T* m_pixels;
     int m_idx;
     int m_xsize;
     int m_ysize;
     double m_xspacing;
     double m_yspacing;
     Matrix4 m_transform;
+    FrameGeometry m_geometry;
 };
 
 #endif //METAIMAGE_HPP
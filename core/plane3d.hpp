@@ -86,7 +86,7 @@ public:
    * @param i coefficient to get
    * @return coefficient
    */
-  inline double getCoefficient(const int i)
+  inline double getCoefficient(const int i) const
     {
       return m_coeffs[i];
     }
@@ -0,0 +1,155 @@
+#ifndef PLANE_BATCH_HPP
+#define PLANE_BATCH_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <vector>
+#include <Eigen/Dense>
+#include "plane3d.hpp"
+#include "frame_geometry.hpp"
+#include "metaimage.hpp"
+#include "simd_dispatch.hpp"
+
+/// Number of planes handled by one call of PlaneBatch::distances()
+const int PLANE_BATCH_BLOCK_SIZE = 64;
+
+/**
+ * The image planes of a set of frames, packed for batched distance computations.
+ *
+ * The coefficients of all planes are stored as the rows of a matrix, and the points
+ * of a curve as one row per axis, so the signed distances from every point to a block
+ * of planes are computed by a vectorized kernel, see simdPlaneDistances().
+ * The geometry records of the frames are kept alongside, contiguously, for the
+ * per-intersection work that follows.
+ * Built once per set of frames and shared by all splines intersected with them.
+ */
+template<typename T>
+class PlaneBatch
+{
+public:
+    typedef Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> DistanceMatrix;
+    typedef Eigen::Matrix<T, 3, Eigen::Dynamic, Eigen::RowMajor> PointMatrix;
+
+    /**
+   * Constructor. Packs the geometry of the frames, see MetaImage::getGeometry()
+   * @param frames The frames
+   */
+    explicit PlaneBatch(const std::vector<MetaImage<inData_t> >& frames) :
+        m_coeffs(frames.size(), 4), m_geometry(frames.size())
+    {
+        for(size_t f = 0; f < frames.size(); f++)
+        {
+            m_geometry[f] = frames[f].getGeometry();
+            for(int i = 0; i < 4; i++)
+            {
+                m_coeffs(f, i) = m_geometry[f].plane[i];
+            }
+        }
+    }
+
+    /**
+   * Constructor. Packs the given planes, the rest of the geometry is zero
+   * @param planes The planes
+   */
+    explicit PlaneBatch(const std::vector<Plane3D>& planes) :
+        m_coeffs(planes.size(), 4), m_geometry(planes.size())
+    {
+        for(size_t f = 0; f < planes.size(); f++)
+        {
+            for(int i = 0; i < 4; i++)
+            {
+                m_geometry[f].plane[i] = planes[f].getCoefficient(i);
+                m_coeffs(f, i) = m_geometry[f].plane[i];
+            }
+        }
+    }
+
+    /**
+   * @return the number of planes
+   */
+    size_t
+    size() const
+    {
+        return m_coeffs.rows();
+    }
+
+    /**
+   * @param f Plane index
+   * @return plane number f
+   */
+    Plane3D
+    getPlane(size_t f) const
+    {
+        return m_geometry[f].getPlane();
+    }
+
+    /**
+   * @param f Plane index
+   * @return the geometry of frame number f
+   */
+    const FrameGeometry&
+    getGeometry(size_t f) const
+    {
+        return m_geometry[f];
+    }
+
+    /**
+   * Pack the points of a curve, one row per axis, for distances()
+   * @param points The points, one vector per axis
+   * @return 3 x N matrix of the points
+   */
+    static PointMatrix
+    packPoints(const std::vector<T> points[3])
+    {
+        const int n = points[0].size();
+        PointMatrix packed(3, n);
+        for(int i = 0; i < 3; i++)
+        {
+            packed.row(i) = Eigen::Map<const Eigen::Matrix<T, 1, Eigen::Dynamic> >(points[i].data(), n);
+        }
+        return packed;
+    }
+
+    /**
+   * Compute the signed distances from points to a range of planes
+   * @param points The packed points, see packPoints()
+   * @param first The first plane
+   * @param n Number of planes
+   * @param distances Receives the n x N distances, row f is for plane first+f
+   */
+    void
+    distances(const PointMatrix& points, size_t first, size_t n, DistanceMatrix& distances) const
+    {
+        const size_t nPoints = points.cols();
+        distances.resize(n, nPoints);
+        const T* x = points.data();
+        simdPlaneDistances(m_coeffs.data() + 4*first, n, x, x + nPoints, x + 2*nPoints, nPoints, distances.data());
+    }
+
+    /**
+   * How far the distances computed by distances() may be from those of Plane3D::getDistance(),
+   * which computes in double
+   * @param f Plane index
+   * @param maxAbs The largest absolute coordinate along each axis of the points
+   * @return a bound on the rounding difference
+   */
+    T
+    tolerance(size_t f, const T maxAbs[3]) const
+    {
+        T magnitude = std::abs(m_coeffs(f, 3));
+        for(int i = 0; i < 3; i++)
+        {
+            magnitude += std::abs(m_coeffs(f, i))*maxAbs[i];
+        }
+        // 1e-12 for double, a few units of rounding for float
+        const T relative = std::max(T(1e-12), T(64)*std::numeric_limits<T>::epsilon());
+        return relative*magnitude;
+    }
+
+private:
+    Eigen::Matrix<T, Eigen::Dynamic, 4, Eigen::RowMajor> m_coeffs;
+    std::vector<FrameGeometry> m_geometry;
+};
+
+#endif // PLANE_BATCH_HPP
@@ -1,11 +1,26 @@
 #ifndef PRECISION_H
 #define PRECISION_H
 
-// The type to use for all internal calculations
-// Haven't tested with anything else than double, things may break!
-//#define D double
+// The type to use for all internal calculations is the template parameter of
+// AngleCorrectionT, double or float (AngleCorrection and AngleCorrectionFloat)
 // The type to assume a metaimage contains
 #define inData_t float
 
+/**
+ * The type to accumulate sums of values of type T in.
+ * Sums over many single precision samples are kept in double, see IntersectionSet
+ */
+template<typename T>
+struct AccumulatorType
+{
+    typedef T Type;
+};
+
+template<>
+struct AccumulatorType<float>
+{
+    typedef double Type;
+};
+
 
 #endif
@@ -0,0 +1,54 @@
+#ifndef QUADRATIC_ROOTS_HPP
+#define QUADRATIC_ROOTS_HPP
+
+#include <Eigen/Dense>
+
+/**
+ * Batched solver for the quadratic equations a t^2 + b t + c = 0 giving the
+ * crossings between a spline segment and a plane, see Spline3D::findRoots().
+ *
+ * The equations are given as arrays of coefficients (structure of arrays), and all
+ * of them are solved with branch free, vectorized array expressions. The rules are
+ * the same as in the scalar solver: a slightly negative discriminant (down to -0.01)
+ * counts as zero, and only roots in [0,1] are kept, the larger-numerator root first.
+ */
+template<typename T>
+class QuadraticRoots
+{
+public:
+    typedef Eigen::Array<T, Eigen::Dynamic, 1> Array;
+    typedef Eigen::Array<int, Eigen::Dynamic, 1> IndexArray;
+    typedef Eigen::Array<bool, Eigen::Dynamic, 1> BoolArray;
+
+    /**
+   * Solve a batch of quadratic equations
+   * @param a Second order coefficients
+   * @param b First order coefficients
+   * @param c Constant terms
+   * @param root Receives the first root in [0,1] of each equation, if any
+   * @param second Receives the second root in [0,1] of each equation with two of them
+   * @param count Receives the number of roots in [0,1] of each equation
+   */
+    static void
+    solve(const Array& a, const Array& b, const Array& c, Array& root, Array& second, IndexArray& count)
+    {
+        const T zero = 0.0;
+        const T one = 1.0;
+        Array d = b*b - T(4)*a*c;
+        // Rounding may give a slightly negative discriminant for a double root
+        d = (d >= T(-0.01) && d < zero).select(Array::Zero(d.size()), d);
+        const Array sqrtD = d.max(zero).sqrt();
+        const Array r1 = (-b + sqrtD)/(T(2.0)*a);
+        const Array r2 = (-b - sqrtD)/(T(2.0)*a);
+
+        const BoolArray real = d >= zero;
+        const BoolArray in1 = real && r1 >= zero && r1 <= one;
+        // A double root is only counted once
+        const BoolArray in2 = real && d != zero && r2 >= zero && r2 <= one;
+        count = in1.template cast<int>() + in2.template cast<int>();
+        root = in1.select(r1, r2);
+        second = r2;
+    }
+};
+
+#endif // QUADRATIC_ROOTS_HPP
@@ -1,16 +1,170 @@
 #ifndef SPLINE_FITTER_HPP
 #define SPLINE_FITTER_HPP
+#include <map>
+#include <memory>
+#include <mutex>
 #include <vector>
-#include <Eigen/SparseLU>
+
+/// Number of factorizations kept by QuadraticSplineFactorization::get()
+const size_t SPLINE_FACTORIZATION_CACHE_SIZE = 64;
+
+/**
+ * LU factorization of the interpolation matrix of a quadratic B-spline.
+ *
+ * For N points to interpolate there are N+2 control points x_0 ... x_{N+1}, given by
+ *     x_1 - x_0 = 0
+ *     0.125 x_{i-1} + 0.75 x_i + 0.125 x_{i+1} = p_{i-1},  i = 1 ... N
+ *     x_{N+1} - x_N = 0
+ * Substituting the two end conditions into the neighbouring rows leaves a symmetric,
+ * strictly diagonally dominant tridiagonal system in x_1 ... x_N, which is solved by
+ * the Thomas algorithm without pivoting in O(N).
+ * The factorization only depends on N, and one factorization solves any number of axes.
+ */
+template<typename T>
+class QuadraticSplineFactorization
+{
+public:
+  /**
+   * Constructor. Factorizes the interpolation matrix
+   * @param nPoints Number of points to interpolate
+   */
+  explicit QuadraticSplineFactorization(int nPoints) :
+    m_n(nPoints), m_upper(nPoints), m_invPivot(nPoints)
+  {
+    const T off = 0.125;
+    T upper = 0.0;
+    for(int i = 0; i < m_n; i++)
+    {
+      // The end rows got the substituted end control point added to their diagonal
+      T diag = 0.75;
+      if(i == 0) diag += off;
+      if(i == m_n-1) diag += off;
+
+      m_invPivot[i] = 1.0/(diag - off*upper);
+      upper = off*m_invPivot[i];
+      m_upper[i] = upper;
+    }
+  }
+
+  /**
+   * Get the factorization for a number of points from a process wide cache.
+   * The factorization only depends on the number of points, so branches of equal
+   * length, and repeated fits of the same branch, share it.
+   * The least recently used factorization is dropped when the cache is full.
+   * Thread safe.
+   * @param nPoints Number of points to interpolate
+   * @return the shared factorization
+   */
+  static std::shared_ptr<const QuadraticSplineFactorization>
+  get(int nPoints)
+  {
+    static std::mutex mutex;
+    static std::map<int, CacheEntry> cache;
+    static unsigned long useCount = 0;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = cache.find(nPoints);
+    if(it == cache.end())
+    {
+      if(cache.size() >= SPLINE_FACTORIZATION_CACHE_SIZE)
+      {
+        auto oldest = cache.begin();
+        for(auto entry = cache.begin(); entry != cache.end(); ++entry)
+        {
+          if(entry->second.lastUse < oldest->second.lastUse) oldest = entry;
+        }
+        cache.erase(oldest);
+      }
+      it = cache.insert(std::make_pair(nPoints, CacheEntry())).first;
+      it->second.factorization = std::make_shared<const QuadraticSplineFactorization>(nPoints);
+    }
+    it->second.lastUse = ++useCount;
+    return it->second.factorization;
+  }
+
+  /**
+   * @return the number of points to interpolate this factorization is for
+   */
+  inline int
+  getNumberOfPoints() const
+  {
+    return m_n;
+  }
+
+  /**
+   * Compute the control points for several axes at once
+   * @param points nAxes vectors of getNumberOfPoints() points to interpolate
+   * @param cpoints nAxes vectors receiving the getNumberOfPoints()+2 control points
+   * @param nAxes Number of axes
+   */
+  void
+  solve(const std::vector<T>* points, std::vector<T>* cpoints, int nAxes) const
+  {
+    const T off = 0.125;
+    for(int a = 0; a < nAxes; a++)
+    {
+      cpoints[a].resize(m_n+2);
+    }
+    if(m_n == 0)
+    {
+      for(int a = 0; a < nAxes; a++)
+      {
+        cpoints[a][0] = cpoints[a][1] = 0.0;
+      }
+      return;
+    }
+
+    // Forward elimination, the intermediate results are kept in the output
+    for(int a = 0; a < nAxes; a++)
+    {
+      cpoints[a][1] = points[a][0]*m_invPivot[0];
+    }
+    for(int i = 1; i < m_n; i++)
+    {
+      for(int a = 0; a < nAxes; a++)
+      {
+        cpoints[a][i+1] = (points[a][i] - off*cpoints[a][i])*m_invPivot[i];
+      }
+    }
+
+    // Back substitution
+    for(int i = m_n-2; i >= 0; i--)
+    {
+      for(int a = 0; a < nAxes; a++)
+      {
+        cpoints[a][i+1] -= m_upper[i]*cpoints[a][i+2];
+      }
+    }
+
+    // End conditions
+    for(int a = 0; a < nAxes; a++)
+    {
+      cpoints[a][0] = cpoints[a][1];
+      cpoints[a][m_n+1] = cpoints[a][m_n];
+    }
+  }
+
+private:
+  struct CacheEntry
+  {
+    std::shared_ptr<const QuadraticSplineFactorization> factorization;
+    unsigned long lastUse;
+  };
+
+  int m_n;
+  std::vector<T> m_upper;
+  std::vector<T> m_invPivot;
+};
+
 
 /**
  * Quadratic B-spline curve fitter
- * This class computes the control points necessary to make a quadratic B-spline curve 
+ * This class computes the control points necessary to make a quadratic B-spline curve
  * interpolating a known set of points.
  *
  */
 template<typename T>
-class QuadraticSplineFitter 
+class QuadraticSplineFitter
 {
 public:
 
@@ -28,96 +182,43 @@ public:
   QuadraticSplineFitter(std::vector<T>& points){
     setPoints(points);
   }
-  
+
   /**
    * Set points to interpolate
-   * @param points points to interpolate 
+   * @param points points to interpolate
    */
   inline void
   setPoints(std::vector<T>& points)
   {
     m_points = points;
   }
-  
- 
+
+
   /**
    * Compute the control points necessary to interpolate the points set by setPoints
    * @return the control points
    */
-  std::vector<T> 
+  std::vector<T>
   compute_control_points() const
   {
-    // Here:
-    // Build a NxN matrix such that
-    // matrix[row][row] =  matrix[row][row+1] = 1/2
-    // rest = 0
-    // build B such that B = [ep_start points ep_stop]
-    // Solve Ax = B
-    // x are the knots
-    int n = m_points.size()+2;
-    Eigen::SparseMatrix<T> A(n,n);
-      
-    Eigen::Matrix<T, Eigen::Dynamic, 1> b(n);
-    std::vector<Eigen::Triplet<T> > triplets;
-    triplets.reserve((n)*2);
-      
-    // Initialize coefficients for the points to reach
-    
-    for(int i = 1; i < n-1; i++)
-    {
-      triplets.push_back(Eigen::Triplet<T>(i,i-1,0.125));
-      triplets.push_back(Eigen::Triplet<T>(i,i,0.75));
-      triplets.push_back(Eigen::Triplet<T>(i,i+1,0.125));
-      b(i) = m_points[i-1];
-    }
-      
-    __insertStartpointCoeffs(triplets,b,0);
-    __insertEndpointCoeffs(triplets,b,n-1);
-    A.setFromTriplets(triplets.begin(), triplets.end());
-     
-    // Now solve the linear system using linear least squares
-    Eigen::Matrix<T, Eigen::Dynamic, 1> x(n);
-    Eigen::SparseLU<Eigen::SparseMatrix<T> > solver;
-
-    solver.compute(A);
-    x = solver.solve(b);
-
-    //     printVector(x,n);
-    // Copy back to std::vector
     std::vector<T> ret;
-      
-    ret.reserve(n);
-    for(int i = 0; i < n; i++)
-    {
-      ret.push_back(x(i));
-    }
+    QuadraticSplineFactorization<T>::get(m_points.size())->solve(&m_points, &ret, 1);
     return ret;
-      
   }
 
-	  
-  
-private:
-  inline void 
-  __insertStartpointCoeffs( std::vector<Eigen::Triplet<T> >& triplets, 
-			    Eigen::Matrix<T, Eigen::Dynamic, 1>& b, 
-			    const int i) const
+  /**
+   * Compute the control points for the three axes of a curve,
+   * using the cached factorization of the interpolation matrix
+   * @param points The points to interpolate, one vector per axis
+   * @param cpoints The control points are returned here
+   */
+  static void
+  computeControlPoints(const std::vector<T> points[3], std::vector<T> cpoints[3])
   {
-    triplets.push_back(Eigen::Triplet<T>(i,i,-1));
-    triplets.push_back(Eigen::Triplet<T>(i,i+1,1));
-    b(i) = 0.0;
+    QuadraticSplineFactorization<T>::get(points[0].size())->solve(points, cpoints, 3);
   }
 
-  inline void 
-  __insertEndpointCoeffs( std::vector<Eigen::Triplet<T> >& triplets, 
-			  Eigen::Matrix<T, Eigen::Dynamic, 1>& b, 
-			  const int i) const
-  {
-    triplets.push_back(Eigen::Triplet<T>(i,i-1,-1));
-    triplets.push_back(Eigen::Triplet<T>(i,i,1));
-    b(i) = 0.0;
-  }
-	
+private:
   std::vector<T> m_points;
 
 };
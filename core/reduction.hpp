@@ -0,0 +1,100 @@
+#ifndef REDUCTION_HPP
+#define REDUCTION_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <utility>
+#include <vector>
+#include "task_scheduler.hpp"
+
+/**
+ * Deterministic parallel reductions.
+ *
+ * Floating point addition is not associative, so the result of a parallel sum
+ * normally depends on how the range was split over the threads. The reductions
+ * here always split the range into blocks of REDUCTION_BLOCK_SIZE elements, reduce
+ * each block from left to right, and combine the block results in a balanced
+ * pairwise tree. The shape of the computation only depends on the number of
+ * elements, so the result is bit-identical for any number of threads, and the
+ * pairwise combination also keeps the rounding error low for long ranges.
+ */
+
+/// Number of elements reduced sequentially by a single task
+const size_t REDUCTION_BLOCK_SIZE = 64;
+
+namespace reduction_detail
+{
+/**
+ * Combine values[begin, end) as a balanced binary tree
+ */
+template<typename V, typename Combine>
+V
+pairwise(const std::vector<V>& values, size_t begin, size_t end, const Combine& combine)
+{
+    if(end-begin == 1) return values[begin];
+    size_t mid = begin + (end-begin)/2;
+    return combine(pairwise(values, begin, mid, combine), pairwise(values, mid, end, combine));
+}
+}
+
+/**
+ * Reduce the range [0,n) deterministically
+ * @param n Number of elements
+ * @param identity The neutral element of combine
+ * @param map Function returning the value of element i
+ * @param combine Associative function combining two values
+ * @param scheduler The scheduler running the blocks in parallel
+ * @return combine of map(i) over all i, or identity if n is 0
+ */
+template<typename V, typename Map, typename Combine>
+V
+deterministicReduce(size_t n, const V& identity, const Map& map, const Combine& combine,
+                    TaskScheduler& scheduler = TaskScheduler::instance())
+{
+    if(n == 0) return identity;
+    const size_t nBlocks = (n + REDUCTION_BLOCK_SIZE - 1)/REDUCTION_BLOCK_SIZE;
+    std::vector<V> partial(nBlocks, identity);
+    auto reduceBlock = [&](size_t b)
+    {
+        const size_t end = std::min(n, (b+1)*REDUCTION_BLOCK_SIZE);
+        V acc = identity;
+        for(size_t i = b*REDUCTION_BLOCK_SIZE; i < end; i++)
+        {
+            acc = combine(acc, map(i));
+        }
+        partial[b] = acc;
+    };
+    if(nBlocks == 1)
+    {
+        reduceBlock(0);
+        return partial[0];
+    }
+    scheduler.parallelFor(0, nBlocks, reduceBlock);
+    return reduction_detail::pairwise(partial, 0, nBlocks, combine);
+}
+
+/**
+ * Sum the range [0,n) deterministically
+ * @param n Number of elements
+ * @param term Function returning element i
+ * @return the sum of term(i) over all i
+ */
+template<typename T, typename Map>
+T
+deterministicSum(size_t n, const Map& term)
+{
+    return deterministicReduce<T>(n, T(0), term, [](T a, T b){ return a + b; });
+}
+
+/**
+ * Sum two pairs of values elementwise, the deterministicReduce() combine
+ * function for estimators accumulating a numerator and a denominator
+ */
+template<typename T>
+std::pair<T,T>
+pairSum(const std::pair<T,T>& a, const std::pair<T,T>& b)
+{
+    return std::make_pair(a.first + b.first, a.second + b.second);
+}
+
+#endif // REDUCTION_HPP
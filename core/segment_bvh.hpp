@@ -0,0 +1,212 @@
+#ifndef SEGMENT_BVH_HPP
+#define SEGMENT_BVH_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <vector>
+#include "plane3d.hpp"
+
+/// Maximal number of segments in a leaf of a SegmentBVH
+const int SEGMENT_BVH_LEAF_SIZE = 8;
+
+/**
+ * Bounding volume hierarchy over the segments of a polyline.
+ *
+ * Segment i runs from point i to point i+1. Every node holds the axis aligned
+ * bounding box of a contiguous range of segments, and its two children split the
+ * range in halves. Since consecutive points of a curve are close, contiguous ranges
+ * give tight boxes, and the ordering of the segments is kept, so the segments a plane
+ * may cross can be visited in increasing order without visiting the others.
+ */
+template<typename T>
+class SegmentBVH
+{
+public:
+    /**
+   * Constructor. Makes an empty hierarchy
+   */
+    SegmentBVH()
+    {
+    }
+
+    /**
+   * Build the hierarchy
+   * @param points The points of the polyline, one vector per axis
+   */
+    void
+    build(const std::vector<T> points[3])
+    {
+        m_nodes.clear();
+        m_prefix.clear();
+        const int nSegments = (int)points[0].size()-1;
+        if(nSegments < 1) return;
+        m_nodes.reserve(2*(nSegments/SEGMENT_BVH_LEAF_SIZE+1));
+        buildNode(points, 0, nSegments);
+
+        // The box of points 0 ... k for every k, grown one point at a time
+        m_prefix.resize(nSegments+1);
+        T lo[3], hi[3];
+        for(int k = 0; k <= nSegments; k++)
+        {
+            for(int i = 0; i < 3; i++)
+            {
+                lo[i] = k == 0 ? points[i][0] : std::min(lo[i], points[i][k]);
+                hi[i] = k == 0 ? points[i][0] : std::max(hi[i], points[i][k]);
+                m_prefix[k].center[i] = 0.5*(lo[i] + hi[i]);
+                m_prefix[k].halfSize[i] = 0.5*(hi[i] - lo[i]);
+            }
+        }
+    }
+
+    /**
+   * @return true if there are no segments
+   */
+    bool
+    empty() const
+    {
+        return m_nodes.empty();
+    }
+
+    /**
+   * Call visit(i) for the segments from <= i < to whose bounding box is touched by the plane,
+   * in increasing order, until visit returns true.
+   * Segments whose bounding box is strictly on one side of the plane are never visited,
+   * so no segment with end points on different sides of the plane is missed.
+   * @param plane The plane
+   * @param visit Function taking a segment index and returning true to stop
+   * @param from The first segment to consider
+   * @param to One past the last segment to consider, negative for all
+   * @return the segment visit returned true for, or -1
+   */
+    template<typename F>
+    int
+    findSegment(const Plane3D& plane, const F& visit, int from = 0, int to = -1) const
+    {
+        if(m_nodes.empty()) return -1;
+        T normal[3];
+        for(int i = 0; i < 3; i++)
+        {
+            normal[i] = plane.getCoefficient(i);
+        }
+        if(to < 0) to = m_nodes[0].end;
+        return findInNode(0, normal, plane.getCoefficient(3), from, to, visit);
+    }
+
+    /**
+   * Check with a single bounding box that no segment before a given one can cross a plane.
+   * A cheap alternative to findSegment() over the same range, which may still be needed
+   * when the box is touched by the plane.
+   * @param plane The plane
+   * @param to One past the last segment to check
+   * @return true if the segments 0 <= i < to are all strictly on one side of the plane
+   */
+    bool
+    beforeIsClear(const Plane3D& plane, int to) const
+    {
+        if(to <= 0) return true;
+        if(to >= (int)m_prefix.size()) return false;
+        T normal[3];
+        for(int i = 0; i < 3; i++)
+        {
+            normal[i] = plane.getCoefficient(i);
+        }
+        return !touches(m_prefix[to], normal, plane.getCoefficient(3));
+    }
+
+private:
+    struct Box
+    {
+        T center[3];
+        T halfSize[3];
+    };
+
+    struct Node : public Box
+    {
+        int begin;
+        int end;
+        // The left child follows the node, -1 for leaves
+        int right;
+    };
+
+    int
+    buildNode(const std::vector<T> points[3], int begin, int end)
+    {
+        int idx = m_nodes.size();
+        m_nodes.push_back(Node());
+        for(int i = 0; i < 3; i++)
+        {
+            const T* first = &points[i][begin];
+            const T* last = &points[i][end]+1;
+            std::pair<const T*, const T*> range = std::minmax_element(first, last);
+            m_nodes[idx].center[i] = 0.5*(*range.first + *range.second);
+            m_nodes[idx].halfSize[i] = 0.5*(*range.second - *range.first);
+        }
+        m_nodes[idx].begin = begin;
+        m_nodes[idx].end = end;
+        m_nodes[idx].right = -1;
+        if(end-begin > SEGMENT_BVH_LEAF_SIZE)
+        {
+            int mid = begin + (end-begin)/2;
+            buildNode(points, begin, mid);
+            int right = buildNode(points, mid, end);
+            m_nodes[idx].right = right;
+        }
+        return idx;
+    }
+
+    template<typename F>
+    int
+    findInNode(int idx, const T normal[3], T offset, int from, int to, const F& visit) const
+    {
+        const Node& node = m_nodes[idx];
+        if(node.end <= from || node.begin >= to) return -1;
+        if(!touches(node, normal, offset)) return -1;
+
+        if(node.right < 0)
+        {
+            const int end = std::min(node.end, to);
+            for(int i = std::max(node.begin, from); i < end; i++)
+            {
+                if(visit(i)) return i;
+            }
+            return -1;
+        }
+        int found = findInNode(idx+1, normal, offset, from, to, visit);
+        if(found >= 0) return found;
+        return findInNode(node.right, normal, offset, from, to, visit);
+    }
+
+    /**
+   * @return false if the box is strictly on one side of the plane, allowing for rounding
+   */
+    static bool
+    touches(const Box& box, const T normal[3], T offset)
+    {
+        // Distance from the box center, and how much it varies over the box
+        T dist = offset;
+        T radius = 0.0;
+        T magnitude = std::abs(offset);
+        for(int i = 0; i < 3; i++)
+        {
+            dist += normal[i]*box.center[i];
+            radius += std::abs(normal[i])*box.halfSize[i];
+            magnitude += std::abs(normal[i])*(std::abs(box.center[i]) + box.halfSize[i]);
+        }
+        // Allow for rounding, the segment test evaluates the distances differently
+        return std::abs(dist) <= radius + relativeTolerance()*magnitude;
+    }
+
+    static T
+    relativeTolerance()
+    {
+        // 1e-10 for double, a few units of rounding for float
+        return std::max(T(1e-10), T(64)*std::numeric_limits<T>::epsilon());
+    }
+
+    std::vector<Node> m_nodes;
+    // The box of points 0 ... k, see beforeIsClear()
+    std::vector<Box> m_prefix;
+};
+
+#endif // SEGMENT_BVH_HPP
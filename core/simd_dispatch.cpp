@@ -0,0 +1,105 @@
+#include "simd_dispatch.hpp"
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+/**
+* Implementation of the runtime selection of the SIMD kernels
+*
+*/
+
+extern const SimdKernels simdKernelsGeneric;
+#ifdef ANGLECORR_SIMD_X86
+extern const SimdKernels simdKernelsSse4;
+extern const SimdKernels simdKernelsAvx2;
+extern const SimdKernels simdKernelsAvx512;
+#endif
+
+namespace
+{
+const SimdLevel SIMD_LEVELS[] = {SIMD_GENERIC, SIMD_SSE4, SIMD_AVX2, SIMD_AVX512};
+
+const SimdKernels* kernelTable(SimdLevel level)
+{
+    switch(level)
+    {
+#ifdef ANGLECORR_SIMD_X86
+    case SIMD_AVX512: return &simdKernelsAvx512;
+    case SIMD_AVX2: return &simdKernelsAvx2;
+    case SIMD_SSE4: return &simdKernelsSse4;
+#endif
+    case SIMD_GENERIC: return &simdKernelsGeneric;
+    default: return NULL;
+    }
+}
+
+SimdLevel selectSimdLevel()
+{
+    SimdLevel level = detectSimdLevel();
+    const char* env = std::getenv("ANGLECORR_SIMD_LEVEL");
+    if(env)
+    {
+        bool known = false;
+        for(SimdLevel requested: SIMD_LEVELS)
+        {
+            if(std::strcmp(env, simdLevelName(requested)) != 0) continue;
+            known = true;
+            if(requested > level)
+            {
+                std::cerr << "ANGLECORR_SIMD_LEVEL=" << env << " is not supported here, using "
+                          << simdLevelName(level) << std::endl;
+            }
+            else
+            {
+                level = requested;
+            }
+        }
+        if(!known)
+        {
+            std::cerr << "Unknown ANGLECORR_SIMD_LEVEL=" << env << ", using " << simdLevelName(level) << std::endl;
+        }
+    }
+    return level;
+}
+}
+
+
+SimdLevel detectSimdLevel()
+{
+#ifdef ANGLECORR_SIMD_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx512f")) return SIMD_AVX512;
+    if(__builtin_cpu_supports("avx2")) return SIMD_AVX2;
+    if(__builtin_cpu_supports("sse4.2")) return SIMD_SSE4;
+#endif
+    return SIMD_GENERIC;
+}
+
+
+const char* simdLevelName(SimdLevel level)
+{
+    switch(level)
+    {
+    case SIMD_AVX512: return "avx512";
+    case SIMD_AVX2: return "avx2";
+    case SIMD_SSE4: return "sse4";
+    default: return "generic";
+    }
+}
+
+
+const SimdKernels& simdKernels(SimdLevel level)
+{
+    const SimdLevel supported = detectSimdLevel();
+    if(level > supported) level = supported;
+    const SimdKernels* kernels = kernelTable(level);
+    return kernels ? *kernels : simdKernelsGeneric;
+}
+
+
+const SimdKernels& simdKernels()
+{
+    static const SimdKernels& kernels = simdKernels(selectSimdLevel());
+    return kernels;
+}
@@ -0,0 +1,161 @@
+#ifndef SIMD_DISPATCH_HPP
+#define SIMD_DISPATCH_HPP
+
+#include <cstddef>
+
+/**
+ * Runtime selection of the instruction set for the vectorized kernels.
+ *
+ * The kernels in simd_kernels.hpp are compiled once per instruction set level,
+ * each in its own translation unit with its own compiler flags, and the best level
+ * the CPU supports is chosen the first time a kernel is used. The environment
+ * variable ANGLECORR_SIMD_LEVEL (generic, sse4, avx2 or avx512) forces a lower level,
+ * for testing.
+ *
+ * All levels give bit-identical results: the kernels fix the order of every sum,
+ * and are compiled without contraction into fused multiply-adds.
+ */
+enum SimdLevel
+{
+    SIMD_GENERIC = 0,
+    SIMD_SSE4,
+    SIMD_AVX2,
+    SIMD_AVX512
+};
+
+/**
+ * Statistics of a set of samples, like the region grown points of an intersection,
+ * see SimdKernels::regionStatistics
+ */
+struct RegionStatistics
+{
+    /// Number of samples
+    size_t count;
+    /// Number of samples greater than zero
+    size_t positive;
+    /// Number of samples less than zero
+    size_t negative;
+    /// Sum of all samples
+    double sum;
+    /// Sum of the samples greater than zero
+    double positiveSum;
+    /// Sum of the samples less than zero
+    double negativeSum;
+};
+
+/**
+ * The kernels compiled for one instruction set level
+ */
+struct SimdKernels
+{
+    /// The level the kernels were compiled for
+    SimdLevel level;
+
+    /// out[f*nPoints+i] = planes[4f]*x[i] + planes[4f+1]*y[i] + planes[4f+2]*z[i] + planes[4f+3]
+    void (*planeDistances)(const double* planes, size_t nPlanes,
+                           const double* x, const double* y, const double* z, size_t nPoints, double* out);
+    /// Single precision version of planeDistances
+    void (*planeDistancesFloat)(const float* planes, size_t nPlanes,
+                                const float* x, const float* y, const float* z, size_t nPoints, float* out);
+
+    /// out[k] = (c2*u[k] + c1)*u[k] + c0, out may be u
+    void (*quadratic)(double c0, double c1, double c2, const double* u, size_t n, double* out);
+    /// Single precision version of quadratic
+    void (*quadraticFloat)(float c0, float c1, float c2, const float* u, size_t n, float* out);
+
+    /// out[k] = c1*u[k] + c0, out may be u
+    void (*linear)(double c0, double c1, const double* u, size_t n, double* out);
+    /// Single precision version of linear
+    void (*linearFloat)(float c0, float c1, const float* u, size_t n, float* out);
+
+    /// The statistics of x[0] ... x[n-1] in a single pass, the sums in a fixed order
+    void (*regionStatistics)(const double* x, size_t n, RegionStatistics* out);
+    /// Single precision version of regionStatistics, accumulated in double
+    void (*regionStatisticsFloat)(const float* x, size_t n, RegionStatistics* out);
+};
+
+/**
+ * @return the best level supported by the CPU and compiled in
+ */
+SimdLevel detectSimdLevel();
+
+/**
+ * @param level The level
+ * @return the name of the level, as used in ANGLECORR_SIMD_LEVEL
+ */
+const char* simdLevelName(SimdLevel level);
+
+/**
+ * Get the kernels for a level
+ * @param level The level wanted
+ * @return the kernels of the given level, or of the best level below it that the
+ *         CPU supports and that is compiled in
+ */
+const SimdKernels& simdKernels(SimdLevel level);
+
+/**
+ * Get the kernels in use, chosen the first time this is called, see detectSimdLevel()
+ * and ANGLECORR_SIMD_LEVEL. Thread safe.
+ * @return the kernels
+ */
+const SimdKernels& simdKernels();
+
+
+/**
+ * Type dispatch of the kernels, for templates on the floating point type
+ */
+inline void
+simdPlaneDistances(const double* planes, size_t nPlanes,
+                   const double* x, const double* y, const double* z, size_t nPoints, double* out)
+{
+    simdKernels().planeDistances(planes, nPlanes, x, y, z, nPoints, out);
+}
+
+inline void
+simdPlaneDistances(const float* planes, size_t nPlanes,
+                   const float* x, const float* y, const float* z, size_t nPoints, float* out)
+{
+    simdKernels().planeDistancesFloat(planes, nPlanes, x, y, z, nPoints, out);
+}
+
+inline void
+simdQuadratic(double c0, double c1, double c2, const double* u, size_t n, double* out)
+{
+    simdKernels().quadratic(c0, c1, c2, u, n, out);
+}
+
+inline void
+simdQuadratic(float c0, float c1, float c2, const float* u, size_t n, float* out)
+{
+    simdKernels().quadraticFloat(c0, c1, c2, u, n, out);
+}
+
+inline void
+simdLinear(double c0, double c1, const double* u, size_t n, double* out)
+{
+    simdKernels().linear(c0, c1, u, n, out);
+}
+
+inline void
+simdLinear(float c0, float c1, const float* u, size_t n, float* out)
+{
+    simdKernels().linearFloat(c0, c1, u, n, out);
+}
+
+inline RegionStatistics
+simdRegionStatistics(const double* x, size_t n)
+{
+    RegionStatistics statistics;
+    simdKernels().regionStatistics(x, n, &statistics);
+    return statistics;
+}
+
+inline RegionStatistics
+simdRegionStatistics(const float* x, size_t n)
+{
+    RegionStatistics statistics;
+    simdKernels().regionStatisticsFloat(x, n, &statistics);
+    return statistics;
+}
+
+#endif // SIMD_DISPATCH_HPP
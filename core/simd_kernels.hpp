@@ -0,0 +1,121 @@
+#ifndef SIMD_KERNELS_HPP
+#define SIMD_KERNELS_HPP
+
+#include <cstddef>
+#include "simd_dispatch.hpp"
+
+/*
+ * The kernels of SimdKernels, included once by each simd_kernels_<level>.cpp, which
+ * is compiled with the instruction set flags of its level.
+ *
+ * Only plain loops over raw pointers belong here, in an anonymous namespace.
+ * Anything with external linkage, like standard library or Eigen templates, would be
+ * instantiated in every level, and the linker could keep the copy of a higher level
+ * for all of them.
+ */
+namespace
+{
+
+/// Number of partial sums in regionStatistics(), fixed so that the order of the additions does not depend on the level
+const size_t SIMD_SUM_LANES = 8;
+
+template<typename T>
+void
+planeDistances(const T* planes, size_t nPlanes, const T* x, const T* y, const T* z, size_t nPoints, T* out)
+{
+    for(size_t f = 0; f < nPlanes; f++)
+    {
+        const T a = planes[4*f];
+        const T b = planes[4*f+1];
+        const T c = planes[4*f+2];
+        const T d = planes[4*f+3];
+        T* row = out + f*nPoints;
+        for(size_t i = 0; i < nPoints; i++)
+        {
+            row[i] = a*x[i] + b*y[i] + c*z[i] + d;
+        }
+    }
+}
+
+template<typename T>
+void
+quadratic(T c0, T c1, T c2, const T* u, size_t n, T* out)
+{
+    for(size_t k = 0; k < n; k++)
+    {
+        out[k] = (c2*u[k] + c1)*u[k] + c0;
+    }
+}
+
+template<typename T>
+void
+linear(T c0, T c1, const T* u, size_t n, T* out)
+{
+    for(size_t k = 0; k < n; k++)
+    {
+        out[k] = c1*u[k] + c0;
+    }
+}
+
+/// Combine the partial sums of regionStatistics()
+inline double
+combineLanes(const double lanes[SIMD_SUM_LANES])
+{
+    return ((lanes[0] + lanes[1]) + (lanes[2] + lanes[3])) + ((lanes[4] + lanes[5]) + (lanes[6] + lanes[7]));
+}
+
+template<typename T>
+void
+regionStatistics(const T* x, size_t n, RegionStatistics* out)
+{
+    double sums[SIMD_SUM_LANES] = {0.0};
+    double positiveSums[SIMD_SUM_LANES] = {0.0};
+    double negativeSums[SIMD_SUM_LANES] = {0.0};
+    size_t positive[SIMD_SUM_LANES] = {0};
+    size_t negative[SIMD_SUM_LANES] = {0};
+    size_t i = 0;
+    for(; i + SIMD_SUM_LANES <= n; i += SIMD_SUM_LANES)
+    {
+        for(size_t k = 0; k < SIMD_SUM_LANES; k++)
+        {
+            const double v = x[i+k];
+            sums[k] += v;
+            positiveSums[k] += v > 0 ? v : 0.0;
+            negativeSums[k] += v < 0 ? v : 0.0;
+            positive[k] += v > 0;
+            negative[k] += v < 0;
+        }
+    }
+    for(size_t k = 0; i < n; i++, k++)
+    {
+        const double v = x[i];
+        sums[k] += v;
+        positiveSums[k] += v > 0 ? v : 0.0;
+        negativeSums[k] += v < 0 ? v : 0.0;
+        positive[k] += v > 0;
+        negative[k] += v < 0;
+    }
+    out->count = n;
+    out->positive = 0;
+    out->negative = 0;
+    for(size_t k = 0; k < SIMD_SUM_LANES; k++)
+    {
+        out->positive += positive[k];
+        out->negative += negative[k];
+    }
+    out->sum = combineLanes(sums);
+    out->positiveSum = combineLanes(positiveSums);
+    out->negativeSum = combineLanes(negativeSums);
+}
+
+}
+
+/// Initializer of the SimdKernels of a level
+#define SIMD_KERNELS_TABLE(level) \
+    { level, \
+      &planeDistances<double>, &planeDistances<float>, \
+      &quadratic<double>, &quadratic<float>, \
+      &linear<double>, &linear<float>, \
+      &regionStatistics<double>, &regionStatistics<float> }
+
+#endif // SIMD_KERNELS_HPP
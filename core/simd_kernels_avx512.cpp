@@ -0,0 +1,4 @@
+// The kernels compiled for the avx512 level, see the flags of this file in CMakeLists.txt
+#include "simd_kernels.hpp"
+
+extern const SimdKernels simdKernelsAvx512 = SIMD_KERNELS_TABLE(SIMD_AVX512);
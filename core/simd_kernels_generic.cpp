@@ -0,0 +1,4 @@
+// The kernels compiled for the generic level, with the default flags of the build
+#include "simd_kernels.hpp"
+
+extern const SimdKernels simdKernelsGeneric = SIMD_KERNELS_TABLE(SIMD_GENERIC);
@@ -0,0 +1,4 @@
+// The kernels compiled for the sse4 level, see the flags of this file in CMakeLists.txt
+#include "simd_kernels.hpp"
+
+extern const SimdKernels simdKernelsSse4 = SIMD_KERNELS_TABLE(SIMD_SSE4);
@@ -2,12 +2,16 @@
 #define __SPLINE_H
 
 #include <stdint.h>
+#include <algorithm>
+#include <limits>
 #include <vector>
 #include <vtkPolyData.h>
 #include <vtkSmartPointer.h>
 #include <vtkCellArray.h>
+#include "centerline_hash.hpp"
 #include "plane3d.hpp"
 #include "quadratic_spline_fitter.hpp"
+#include "segment_bvh.hpp"
 #include "adjlist.hpp"
 #include "helpers.hpp"
 #include <unordered_map>
@@ -15,6 +19,19 @@
 #include "intersection.hpp"
 #include "intersection_set.hpp"
 #include "metaimage.hpp"
+#include "plane_batch.hpp"
+#include "quadratic_roots.hpp"
+#include "simd_dispatch.hpp"
+#include "task_scheduler.hpp"
+
+/// Number of segments on each side of the previous crossing searched before the full search
+const int INTERSECTION_SEARCH_WINDOW = 16;
+/// Crossings of a frame closer than this along the curve are the same crossing found twice
+const double INTERSECTION_SAME_CROSSING = 1e-6;
+/// Curves with up to this many points are intersected with all frames at once, see Spline3D::findAllIntersections()
+const size_t DENSE_INTERSECTION_MAX_POINTS = 512;
+/// Up to this many smoothing convolutions, Spline3D::smooth() uses every weight of the kernel
+const int SMOOTHING_FULL_KERNEL_MAX = 100;
 
 using namespace std;
 
@@ -42,6 +59,7 @@ public:
         m_initialized = false;
         m_axis = 1;
         m_transform = true;
+        m_allCrossings = false;
     }
 
     /**
@@ -55,6 +73,72 @@ public:
    */
     ~Spline3D() { }
 
+    /**
+   * Copy constructor. The intersections of the copy refer to the copy
+   * @param other The spline to copy
+   */
+    Spline3D(const Spline3D& other) : Spline3D(0)
+    {
+        *this = other;
+    }
+
+    /**
+   * Move constructor. The intersections refer to the new spline
+   * @param other The spline to move from
+   */
+    Spline3D(Spline3D&& other) : Spline3D(0)
+    {
+        *this = std::move(other);
+    }
+
+    /**
+   * Copy assignment. The intersections of the copy refer to the copy
+   * @param other The spline to copy
+   */
+    Spline3D&
+    operator=(const Spline3D& other)
+    {
+        if(this == &other) return *this;
+        for(int i = 0; i < 3; i++)
+        {
+            m_points[i] = other.m_points[i];
+            m_cpoints[i] = other.m_cpoints[i];
+            for(int k = 0; k < 3; k++)
+            {
+                m_power[i][k] = other.m_power[i][k];
+            }
+        }
+        m_segments = other.m_segments;
+        m_intersections = other.m_intersections;
+        copySettings(other);
+        rebindIntersections();
+        return *this;
+    }
+
+    /**
+   * Move assignment. The intersections refer to this spline
+   * @param other The spline to move from
+   */
+    Spline3D&
+    operator=(Spline3D&& other)
+    {
+        if(this == &other) return *this;
+        for(int i = 0; i < 3; i++)
+        {
+            m_points[i] = std::move(other.m_points[i]);
+            m_cpoints[i] = std::move(other.m_cpoints[i]);
+            for(int k = 0; k < 3; k++)
+            {
+                m_power[i][k] = std::move(other.m_power[i][k]);
+            }
+        }
+        m_segments = std::move(other.m_segments);
+        m_intersections = std::move(other.m_intersections);
+        copySettings(other);
+        rebindIntersections();
+        return *this;
+    }
+
     /**
    * Set a point to interpolate
    * @param idx Index to set
@@ -111,6 +195,42 @@ public:
         return m_axis;
     }
 
+    /**
+   * Set whether findAllIntersections() reports every crossing of the curve with a frame,
+   * or only the first crossing along the curve (the default)
+   * @param b true to report all crossings
+   */
+    inline void
+    setAllCrossings(bool b)
+    {
+        m_allCrossings = b;
+    }
+
+    /**
+   * @return true if findAllIntersections() reports every crossing with a frame
+   * @sa setAllCrossings
+   */
+    inline bool
+    getAllCrossings() const
+    {
+        return m_allCrossings;
+    }
+
+    /**
+   * Hash the points to interpolate, to recognize the same branch in another centerline
+   * @return the hash, see hashBytes()
+   */
+    uint64_t
+    hashPoints() const
+    {
+        uint64_t hash = HASH_SEED;
+        for(int i = 0; i < 3; i++)
+        {
+            hash = hashBytes(hash, m_points[i].data(), m_points[i].size()*sizeof(T));
+        }
+        return hash;
+    }
+
     /**
    * Get the length of the spline
    */
@@ -160,6 +280,73 @@ public:
         m_initialized = false;
     }
 
+    /**
+   * Smooth the points to interpolate, with the same result as calling
+   * applyConvolution({0.25, 0.50, 0.25}) nConvolutions times.
+   * n applications of the mask equal one convolution with the binomial kernel
+   * C(2n, n+k)/4^n, k = -n ... n, with the same reflection at the ends, done in a single pass.
+   * Up to SMOOTHING_FULL_KERNEL_MAX convolutions, the range of the GUI, all 2n+1 weights are
+   * used, so the result only differs from repeated application by rounding.
+   * Beyond that the weights below 2^-62 are left out, which changes the points by less
+   * than 1e-16 times the largest coordinate, and the cost grows with the kernel width
+   * (about sqrt(n)) instead of with n.
+   * @param nConvolutions Number of times to apply the mask
+   */
+    void
+    smooth(int nConvolutions)
+    {
+        const int N = m_points[0].size();
+        if(nConvolutions <= 0 || N < 2) return;
+
+        const vector<T> w = binomialKernel(nConvolutions);
+        const int K = w.size()-1;
+        // Reflecting at both ends makes the points periodic
+        const int period = 2*(N-1);
+        auto mirror = [N, period](int idx)
+        {
+            idx %= period;
+            if(idx < 0) idx += period;
+            return idx < N ? idx : period - idx;
+        };
+
+        // Points far enough from the ends need no reflection
+        const int lo = std::min(K, N);
+        const int hi = std::max(N-K, lo);
+
+        vector<T> src(N);
+        for(int j = 0; j < 3; j++)
+        {
+            std::copy(m_points[j].begin(), m_points[j].end(), src.begin());
+            T* dst = m_points[j].data();
+
+            for(int i = lo; i < hi; i++)
+            {
+                dst[i] = w[0]*src[i];
+            }
+            for(int k = 1; k <= K; k++)
+            {
+                const T wk = w[k];
+                for(int i = lo; i < hi; i++)
+                {
+                    dst[i] += wk*(src[i-k] + src[i+k]);
+                }
+            }
+
+            auto boundary = [&](int i)
+            {
+                T sum = w[0]*src[i];
+                for(int k = 1; k <= K; k++)
+                {
+                    sum += w[k]*(src[mirror(i-k)] + src[mirror(i+k)]);
+                }
+                dst[i] = sum;
+            };
+            for(int i = 0; i < lo; i++) boundary(i);
+            for(int i = hi; i < N; i++) boundary(i);
+        }
+        m_initialized = false;
+    }
+
     /**
    * Initializes the underlying spline structure with the provided data.
    * Needs to be called after adding points to the spline before evaluating it.
@@ -169,11 +356,9 @@ public:
     compute()
     {
         // Build splines
-        for(int i = 0; i < 3; i++)
-        {
-            QuadraticSplineFitter<T> fitter(m_points[i]);
-            m_cpoints[i] = fitter.compute_control_points();
-        }
+        QuadraticSplineFitter<T>::computeControlPoints(m_points, m_cpoints);
+        computePowerBasis();
+        m_segments.build(m_points);
         m_initialized = true;
     }
 
@@ -197,6 +382,8 @@ public:
    * Find an intersection between this curve and a plane.
    * The method is to first find two adjacent points in m_points (the points to interpolate)
    * that is on different sides of the plane. Then we call findRoots() to find the exact location between those two points.
+   * The search starts around t, as consecutive frames of a sweep cross the curve close to each other,
+   * but the first crossing along the curve is returned wherever t is.
    * @param t The position to start at. Will contain the intersection position after
    * @param plane The plane to intersect with
    * @param pointOnPlane will contain a point that is both on the curve and on the plane.
@@ -205,62 +392,50 @@ public:
     bool
     intersect(T& t, Plane3D& plane, T pointOnPlane[3]) const
     {
-        // 1. Find two neighbouring points for which the the plane distance function has opposite signs
-        double pt[3];
-        for(int i = 0; i < 3; i++)
-        {
-            pt[i] = m_points[i][0];
-        }
-        int prevsign = sgn(plane.getDistance(pt));
-        int pos = -1;
-        for(unsigned int i = 1; i < m_points[0].size(); i++)
+        if(!m_initialized )
         {
-            for(int j = 0; j < 3; j++)
-            {
-                pt[j] = m_points[j][i];
-            }
-            int sign = sgn(plane.getDistance(pt));
-            if(prevsign != sign){
-                // We found the points:
-                // Points(i-1 and i)
-                pos = i-1;
-                break;
-            }
-            prevsign = sign;
+            reportError("ERROR: Spline3d not initialized");
+            return false;
         }
+
+        // 1. Find the first two neighbouring points for which the the plane distance function has opposite signs.
+        int pos = findCrossingSegment(plane, (int)(t+0.5));
         // Return false if we didn't find an intersection
         if(pos == -1){
             return false;
         }
+        return intersectSegment(pos, plane, t, pointOnPlane);
+    }
 
-        T roots[2];
+    /**
+   * Find the intersection between the plane and the curve near a segment
+   * @param pos The segment, such that m_points[pos] and m_points[pos+1] are on opposite sides of the plane
+   * @param plane The plane to intersect with
+   * @param t Will contain the intersection position, the first one if the curve crosses twice there
+   * @param pointOnPlane will contain a point that is both on the curve and on the plane.
+   * @return true if an intersection was found, false otherwise.
+   */
+    bool
+    intersectSegment(int pos, Plane3D& plane, T& t, T pointOnPlane[3]) const
+    {
+        double roots[2];
         int nroots;
         nroots = findRoots(pos,plane, roots);
         // Rounding errors may cause us to miss the 0-1 interval just slightly, try both
         if(nroots == 0)
             nroots = findRoots(++pos,plane,roots);
-        // Add the position of p0 to the roots
-        roots[0] += pos;
-        roots[1] += pos;
-
-        switch(nroots)
-        {
-        case 0:
-            return false;
-        case 1:
-        case 2:
-            // For now, return only one intersection. May have to fix this.
-            // Subtracting 0.5 because the spline is translated by 0.5 along the t axis.
-            // This way the spline is aligned with the interpolation points (spline(0) == point 0)
-            t = roots[0] - 0.5;
-            //	t = roots[0];
-            evaluateSingle(t,pointOnPlane);
-
-            return true;
-        default:
-            assert(1 == 0);
+        if(nroots == 0)
             return false;
-        }
+        assert(nroots <= 2);
+
+        // Add the position of p0 to the roots.
+        // Subtracting 0.5 because the spline is translated by 0.5 along the t axis.
+        // This way the spline is aligned with the interpolation points (spline(0) == point 0)
+        const double first = nroots == 2 ? std::min(roots[0], roots[1]) : roots[0];
+        t = first + pos - 0.5;
+        evaluateSingle(t,pointOnPlane);
+
+        return true;
     }
 
     /**
@@ -313,6 +488,37 @@ public:
 
 
 
+    /**
+   * Evaluate the curve at many positions at once.
+   * The segment of each position is found by stepping from the previous one, and the
+   * positions in each segment are evaluated from its power basis coefficients with a
+   * vectorized kernel, see simdQuadratic().
+   * @param t The parameter positions, in non-decreasing order
+   * @param n Number of positions
+   * @param points The x, y and z coordinates at t[k] are returned in points[0][k], points[1][k] and points[2][k]
+   * @sa evaluateSingle
+   */
+    void
+    evaluateMany(const T* t, size_t n, T* points[3]) const
+    {
+        evaluatePowerBasis(t, n, points, false);
+    }
+
+    /**
+   * Get the derivative of the curve at many positions at once, see evaluateMany()
+   * @param t The parameter positions, in non-decreasing order
+   * @param n Number of positions
+   * @param points The x, y and z components of the derivative at t[k] are returned in points[0][k], points[1][k] and points[2][k]
+   * @sa derivativeSingle
+   */
+    void
+    derivativeMany(const T* t, size_t n, T* points[3]) const
+    {
+        evaluatePowerBasis(t, n, points, true);
+    }
+
+
+
     /**
    * Contstruct a set of splines representing the centerline described as a set of lines in *data.
    * The algorithm will detect when centerlines split and make separate spline for the branch.
@@ -323,130 +529,161 @@ public:
     build(vtkSmartPointer<vtkPolyData> data)
     {
         // Algorithm:
-        // 1. Make a data structure for each point that holds what line it belongs to (adjacency list)
-        // 2. Iterate over the lines in data, building adjacencies, as well as the rank of each point
-        // 3. Find all points with rank 1 and push it onto point stack
-        // 4. Do (multistart) depth first search
-        //    For every discoevered node, add it to the current spline.
-        //    When a leaf node is found and there are still points on the stack
-        //    make a new spline, adding a few points from before the junction
+        // 1. Collect the lines of data as pairs of point ids, straight from the cell array
+        // 2. Build the adjacency list of the points from them, see AdjList
+        // 3. Build the splines from the graph, see build(AdjList&, const P*)
 
-
-        // Step 1
-        AdjList list(data->GetNumberOfPoints());
-        vector<Spline3D<T> > *ret = new vector<Spline3D<T> >();
-
-        // Step 2: Get the lines from the polyData structure and put them in the AdjList
+        // Step 1: Get the lines from the polyData structure
         vtkCellArray *lines = data->GetLines();
-
-        vtkIdType n_ids;
-        vtkSmartPointer<vtkIdList> idlist = vtkSmartPointer<vtkIdList>::New();
-
-        while(lines->GetNextCell(idlist))
+        vector<int> edges;
+        edges.reserve(2*data->GetNumberOfLines());
+#if VTK_MAJOR_VERSION >= 9
+        for(vtkIdType cell = 0; cell < lines->GetNumberOfCells(); cell++)
+        {
+            vtkIdType n_ids;
+            const vtkIdType* ids;
+            lines->GetCellAtId(cell, n_ids, ids);
+            assert(n_ids == 2);
+            edges.push_back(ids[0]);
+            edges.push_back(ids[1]);
+        }
+#else
+        // The legacy layout, the number of points of each line followed by the point ids
+        const vtkIdType* ids = lines->GetPointer();
+        const vtkIdType* end = ids + lines->GetNumberOfConnectivityEntries();
+        while(ids < end)
         {
-            n_ids = idlist->GetNumberOfIds();
+            const vtkIdType n_ids = ids[0];
             assert(n_ids == 2);
-            list.adjacent(idlist->GetId(0), idlist->GetId(1));
+            edges.push_back(ids[1]);
+            edges.push_back(ids[2]);
+            ids += n_ids + 1;
         }
+#endif
 
-        // Initialize node stack
-        vector<int> stack = vector<int>();
-        // Point stack - this is where the discovered points go.
-        // The array is one for each axis, and there
-        // is one vector per set of control points.
-        // I.e ptstack[2][0] is the set of z coordinates of the control points for curve 0
-        vector<vector<T> > ptstack[3];
+        // Step 2
+        AdjList list(data->GetNumberOfPoints(), edges);
 
-        for(int i = 0; i < 3; i++)
+        // Step 3: Read the coordinates in place if they are stored as float or double
+        vtkDataArray* points = data->GetPoints()->GetData();
+        if(points->GetNumberOfComponents() == 3 && points->GetDataType() == VTK_DOUBLE)
+        {
+            return build(list, static_cast<const double*>(points->GetVoidPointer(0)));
+        }
+        if(points->GetNumberOfComponents() == 3 && points->GetDataType() == VTK_FLOAT)
+        {
+            return build(list, static_cast<const float*>(points->GetVoidPointer(0)));
+        }
+        vector<double> xyz(3*list.size());
+        for(int i = 0; i < list.size(); i++)
         {
-            ptstack[i] = vector<vector<T> >();
-            ptstack[i].push_back(vector<T>());
+            data->GetPoint(i, &xyz[3*i]);
         }
+        return build(list, xyz.data());
+    }
+
+    /**
+   * Make splines from the points of a graph of lines, like a blood vessel centerline
+   * @param graph The adjacency of the points, all nodes are marked visited on return
+   * @param xyz The coordinates of the points, point i is xyz[3*i], xyz[3*i+1], xyz[3*i+2]
+   * @return Vector of splines, one for each branch
+   */
+    template<typename P>
+    static vector<Spline3D<T> >*
+    build(AdjList& graph, const P* xyz)
+    {
+        // Algorithm:
+        // 1. Find all points with rank 1 and push it onto point stack
+        // 2. Do (multistart) depth first search
+        //    For every discoevered node, add it to the current spline.
+        //    When a leaf node is found and there are still points on the stack
+        //    make a new spline, adding a few points from before the junction
+        // 3. Copy the points of each spline to it
+        //
+        // The splines are made one after the other, so the points of all splines are
+        // discovered into a single array, where the points of spline s start at starts[s].
 
-        double pt[3];
-        vector<int> children;
+        const int n = graph.size();
+        // The discovered points, in order
+        vector<int> order;
+        order.reserve(n);
+        vector<int> starts(1, 0);
 
-        // When we hit the end of a curve, we will need to know which point in which control point set
+        // Initialize node stack
+        vector<int> stack;
+        // When we hit the end of a curve, we will need to know which point
         // comes before the new set of control points we will be about to make.
         // The idea is then to keep a stack of "parents", and move it along with the node stack, so that this stack
         // will have the parent information on its head for the point at the
         // stacks head.
-        // The pair is <spline, idx>
-        vector<pair<int,int> > parents = vector<pair<int,int> >();
-
-
-        // Build the splines depth first
-        int curspline = 0;
-
-        vector<int> firstNodes = list.findAllFirst();
+        // The parent is the position in order, -1 for none
+        vector<int> parents;
+        stack.reserve(n);
+        parents.reserve(n);
 
+        // Step 1
+        vector<int> firstNodes = graph.findAllFirst();
         for(int i = firstNodes.size()-1; i >= 0; i--)
         {
             // The initial points have no parents
-            parents.push_back(pair<int,int>(-1, -1));
+            parents.push_back(-1);
             stack.push_back(firstNodes[i]);
         }
 
-        // Do depth first search
+        // Step 2: Do depth first search
         while(!stack.empty())
         {
-
             // Pop stack
             int curnode = stack.back();
             parents.pop_back();
             stack.pop_back();
 
-            // Get the point data for this node
-            data->GetPoint(curnode,pt);
-
             // Assign point to current spline
-            for(int i = 0; i < 3; i++)
-            {
-                ptstack[i][curspline].push_back(pt[i]);
-            }
-
-            list.visit(curnode);
+            order.push_back(curnode);
+            graph.visit(curnode);
 
             // Find all children, add to stack
-            children = list.findAllNext(curnode);
-            if(children.size()!=1 && !stack.empty() )
+            const size_t nodes = stack.size();
+            const int children = graph.findAllNext(curnode, stack);
+            if(children != 1 && nodes != 0)
             {
-                curspline++;
-                int parentspline;
-                int parentidx;
-                parentspline = parents.back().first;
-                parentidx = parents.back().second;
-
                 // Leaf node, we're gonna need a new spline now
-                for(int i = 0; i < 3; i++)
-                {
-                    ptstack[i].push_back(vector<T>());
-
-
-                    // Add old points to the spline. This is needed so that the branches remain continuous
-                    //   ptstack[i][curspline].push_back(ptstack[i][parentspline][parentidx-1]);
-                    if(parentidx != -1)
-                        ptstack[i][curspline].push_back(ptstack[i][parentspline][parentidx]);
-
-                }
+                starts.push_back(order.size());
 
+                // Add old points to the spline. This is needed so that the branches remain continuous
+                int parent = parents.back();
+                if(parent != -1)
+                    order.push_back(order[parent]);
             }
-            stack.insert(stack.end(), children.begin(), children.end());
             // Push the parents of all the children we just pushed to the node stack
             // to the parent stack
-            for(unsigned int i = 0; i < children.size(); i++)
-            {
-                parents.push_back(pair<int,int>(curspline,ptstack[0][curspline].size()-1));
-            }
+            const int last = (int)order.size() > starts.back() ? (int)order.size()-1 : -1;
+            parents.insert(parents.end(), children, last);
         }
+        starts.push_back(order.size());
 
-        // Put all the generated data into the return spline3d structure
-        for(unsigned int i = 0; i < ptstack[0].size(); i++)
+        // Step 3: Put all the generated data into the return spline3d structure
+        vector<Spline3D<T> > *ret = new vector<Spline3D<T> >();
+        size_t nSplines = 0;
+        for(size_t s = 0; s+1 < starts.size(); s++)
+        {
+            if(starts[s+1] - starts[s] > 1) nSplines++;
+        }
+        ret->reserve(nSplines);
+        for(size_t s = 0; s+1 < starts.size(); s++)
         {
-            if(ptstack[0][i].size() > 1) {
-                Spline3D<T> newspline = Spline3D<T>(ptstack[0][i].size());
-                newspline.setPoints(ptstack[0][i], ptstack[1][i], ptstack[2][i]);
-                ret->push_back(newspline);      }
+            const int length = starts[s+1] - starts[s];
+            if(length <= 1) continue;
+            ret->push_back(Spline3D<T>(length));
+            Spline3D<T>& spline = ret->back();
+            for(int j = 0; j < length; j++)
+            {
+                const P* pt = xyz + 3*(size_t)order[starts[s]+j];
+                for(int i = 0; i < 3; i++)
+                {
+                    spline.m_points[i][j] = pt[i];
+                }
+            }
         }
 
         return ret;
@@ -456,6 +693,7 @@ public:
    * Find an intersection with a MetaImage
    *
    * @param img The image to find an intersection with
+   * @param start Parameter position to start the search at, see intersect()
    *
    * @return Intersection instance where the image intersects with the
    *         curve. If no intersection was found, the isValid() method of the
@@ -464,68 +702,61 @@ public:
    * @see Spline3D<T>::intersect()
    */
     Intersection<T>
-    findIntersection(const MetaImage<inData_t> *img) const
+    findIntersection(const MetaImage<inData_t> *img, T start = 0.0) const
     {
-        Plane3D plane(img->getTransform());
-        T t = 0.0;
+        const FrameGeometry& geometry = img->getGeometry();
+        Plane3D plane = geometry.getPlane();
+        T t = start;
         T pt[3];
-        Intersection<T> intersection = Intersection<T>();
         if(intersect(t,plane,pt))
         {
-            intersection.setSpline(this);
-            intersection.setParameterPosition(t);
-            intersection.setValid(true);
-            intersection.setMetaImage(img);
-
-            // Find cos(theta).
-            // cos(theta) = plane Y axis dot spline derivative normalized
-
-            T spline_deriv[3];
-
-            derivativeSingle(t,spline_deriv);
-            T y_axis[3];
-
-            if(m_transform)
-            {
-                for(int i = 0; i < 3; i++)
-                {
-                    y_axis[i] = -img->getTransform()(i,m_axis);
-                }
-            } else {
-                for(int i = 0; i < 3; i++)
-                {
-                    y_axis[i] = -img->getTransform()(m_axis,i);
-                }
-            }
-            double length_y = length3d(y_axis);
-            double length_splinederiv = length3d(spline_deriv);
-
-            T cosTheta = innerProduct(spline_deriv, y_axis)/(length_y*length_splinederiv);
-            intersection.setCosTheta(cosTheta);
+            return makeIntersection(img, geometry, t);
         }
-        return intersection;
+        return Intersection<T>();
     }
-    
+
     /**
    * Find all intersections for a set of images. The result can be retrieved by getIntersections()
-   * and getConstIntersections
+   * and getConstIntersections. Any previously found intersections are discarded.
    *
    * @param imgs Vector of images to intersect with the curve
    */
     void
     findAllIntersections(const vector<MetaImage<inData_t> >& imgs)
     {
-        Intersection<T> intersection;
+        findAllIntersections(imgs, PlaneBatch<T>(imgs));
+    }
 
+    /**
+   * Find all intersections for a set of images. The result can be retrieved by getIntersections()
+   * and getConstIntersections. Any previously found intersections are discarded.
+   *
+   * Short curves are tested against all planes at once with the dense distance matrix of
+   * PlaneBatch, long curves are searched frame by frame, see intersect().
+   * Both give the first crossing along the curve for each frame, or all crossings in
+   * order along the curve if setAllCrossings() is on.
+   *
+   * @param imgs Vector of images to intersect with the curve
+   * @param planes The image planes of imgs
+   */
+    void
+    findAllIntersections(const vector<MetaImage<inData_t> >& imgs, const PlaneBatch<T>& planes)
+    {
+        m_intersections = IntersectionSet<T>();
 
-        for(unsigned int i = 0; i < imgs.size(); i++)
+        vector<vector<Intersection<T> > > found(imgs.size());
+        if(length() <= DENSE_INTERSECTION_MAX_POINTS)
         {
-            intersection = findIntersection(&imgs[i]);
-            if(intersection.isValid())
-            {
-                m_intersections.push_back(intersection);
+            findAllIntersectionsDense(imgs, planes, found);
+        }
+        else
+        {
+            findAllIntersectionsSearch(imgs, planes, found);
+        }
 
-            }
+        for(auto &frame: found)
+        {
+            m_intersections.insert(m_intersections.end(), frame.begin(), frame.end());
         }
     }
 
@@ -552,23 +783,431 @@ public:
 protected:
 
     /**
-   * Find the roots of the quadratic equation that can be built by inserting the basis functions into the plane equation
+   * Copy everything but the point and intersection data
+   */
+    void
+    copySettings(const Spline3D& other)
+    {
+        m_initialized = other.m_initialized;
+        m_transform = other.m_transform;
+        m_allCrossings = other.m_allCrossings;
+        m_axis = other.m_axis;
+    }
+
+    /**
+   * Let the intersections refer to this spline, after copying or moving them here
+   */
+    void
+    rebindIntersections()
+    {
+        for(auto &intersection: m_intersections)
+        {
+            intersection.setSpline(this);
+        }
+    }
+
+    /**
+   * Compute the power basis coefficients of the segments from the control points.
+   * With u = t + 1.5 - pos in [0,1), segment pos is
+   *     c0 + c1 u + c2 u^2
+   * with c0 = (x_{pos-1} + x_pos)/2, c1 = x_pos - x_{pos-1} and c2 = (x_{pos-1} + x_{pos+1})/2 - x_pos,
+   * where x are the control points.
+   */
+    void
+    computePowerBasis()
+    {
+        const int nSegments = (int)m_cpoints[0].size()-2;
+        for(int i = 0; i < 3; i++)
+        {
+            const std::vector<T>& cp = m_cpoints[i];
+            for(int k = 0; k < 3; k++)
+            {
+                m_power[i][k].resize(std::max(nSegments, 0));
+            }
+            for(int s = 0; s < nSegments; s++)
+            {
+                m_power[i][0][s] = 0.5*(cp[s] + cp[s+1]);
+                m_power[i][1][s] = cp[s+1] - cp[s];
+                m_power[i][2][s] = 0.5*(cp[s] + cp[s+2]) - cp[s+1];
+            }
+        }
+    }
+
+    /**
+   * Evaluate the curve or its derivative at many positions, see evaluateMany()
+   */
+    void
+    evaluatePowerBasis(const T* t, size_t n, T* points[3], bool derivative) const
+    {
+        if(!m_initialized )
+        {
+            reportError("ERROR: Spline3d not initialized");
+            return;
+        }
+        if(n == 0) return;
+
+        // Align with m_points (curve(0) == m_points[0]), the parameters are sorted so
+        // the segment only ever moves forward
+        int pos = t[0] + 1.5;
+        for(size_t first = 0; first < n; )
+        {
+            // The run of positions in the segment of t[first]. The local parameters are
+            // stored in the z output, which is evaluated last, in place.
+            T* u = points[2] + first;
+            size_t end = first;
+            for(; end < n; end++)
+            {
+                const T tk = t[end] + 1.5;
+                if(end > first && tk >= pos+1) break;
+                while(tk >= pos+1) pos++;
+                u[end-first] = tk - pos;
+            }
+            const int segment = pos-1;
+            for(int i = 0; i < 3; i++)
+            {
+                const std::vector<T>* power = m_power[i];
+                if(derivative)
+                {
+                    // The derivative is c1 + 2 c2 u
+                    simdLinear(power[1][segment], T(2)*power[2][segment], u, end-first, points[i]+first);
+                }
+                else
+                {
+                    simdQuadratic(power[0][segment], power[1][segment], power[2][segment], u, end-first, points[i]+first);
+                }
+            }
+            first = end;
+        }
+    }
+
+    /**
+   * Make the intersection with an image at a known position
+   * @param img The image
+   * @param geometry The geometry of the image
+   * @param t Parameter position of the crossing
+   * @return the intersection, with cos(theta) computed
+   */
+    Intersection<T>
+    makeIntersection(const MetaImage<inData_t> *img, const FrameGeometry& geometry, T t) const
+    {
+        Intersection<T> intersection = Intersection<T>();
+        intersection.setSpline(this);
+        intersection.setParameterPosition(t);
+        intersection.setValid(true);
+        intersection.setMetaImage(img);
+
+        // Find cos(theta).
+        // cos(theta) = plane Y axis dot spline derivative normalized
+
+        T spline_deriv[3];
+
+        derivativeSingle(t,spline_deriv);
+        double length_splinederiv = length3d(spline_deriv);
+
+        T cosTheta;
+        if(m_transform)
+        {
+            // The image axes are precomputed with unit length
+            T y_axis[3];
+            for(int i = 0; i < 3; i++)
+            {
+                y_axis[i] = -geometry.axes[m_axis][i];
+            }
+            cosTheta = innerProduct(spline_deriv, y_axis)/length_splinederiv;
+        } else {
+            T y_axis[3];
+            for(int i = 0; i < 3; i++)
+            {
+                y_axis[i] = -img->getTransform()(m_axis,i);
+            }
+            double length_y = length3d(y_axis);
+            cosTheta = innerProduct(spline_deriv, y_axis)/(length_y*length_splinederiv);
+        }
+        intersection.setCosTheta(cosTheta);
+        return intersection;
+    }
+    
+    /**
+   * Find the intersections frame by frame, see findAllIntersections()
+   */
+    void
+    findAllIntersectionsSearch(const vector<MetaImage<inData_t> >& imgs, const PlaneBatch<T>& planes,
+                               vector<vector<Intersection<T> > >& found) const
+    {
+        // The frames are searched in parallel blocks. The first frame of a block is
+        // searched with the bounding volume hierarchy, and the search for each of the
+        // others starts at the crossing with the previous frame, see findCrossingSegment()
+        const size_t blockSize = 8;
+        TaskScheduler::instance().parallelFor(0, (imgs.size()+blockSize-1)/blockSize, [&](size_t block)
+        {
+            vector<int> frames;
+            vector<int> segments;
+            int start = -1;
+            const size_t end = std::min(imgs.size(), (block+1)*blockSize);
+            for(size_t i = block*blockSize; i < end; i++)
+            {
+                const Plane3D plane = planes.getPlane(i);
+                if(m_allCrossings)
+                {
+                    m_segments.findSegment(plane, [&](int pos)
+                    {
+                        if(crossesPlane(plane, pos))
+                        {
+                            frames.push_back(i);
+                            segments.push_back(pos);
+                        }
+                        return false;
+                    });
+                    continue;
+                }
+                int pos = findCrossingSegment(plane, start);
+                if(pos >= 0)
+                {
+                    frames.push_back(i);
+                    segments.push_back(pos);
+                    start = pos;
+                }
+            }
+            intersectCandidates(imgs, planes, frames, segments, found);
+        });
+    }
+
+    /**
+   * Find the intersections with the dense distance matrix, see findAllIntersections()
+   */
+    void
+    findAllIntersectionsDense(const vector<MetaImage<inData_t> >& imgs, const PlaneBatch<T>& planes,
+                              vector<vector<Intersection<T> > >& found) const
+    {
+        if(!m_initialized )
+        {
+            reportError("ERROR: Spline3d not initialized");
+            return;
+        }
+        const int nSegments = (int)length()-1;
+        if(nSegments < 1) return;
+
+        const typename PlaneBatch<T>::PointMatrix points = PlaneBatch<T>::packPoints(m_points);
+        T maxAbs[3];
+        for(int j = 0; j < 3; j++)
+        {
+            maxAbs[j] = points.row(j).cwiseAbs().maxCoeff();
+        }
+
+        const size_t nBlocks = (imgs.size()+PLANE_BATCH_BLOCK_SIZE-1)/PLANE_BATCH_BLOCK_SIZE;
+        TaskScheduler::instance().parallelFor(0, nBlocks, [&](size_t block)
+        {
+            const size_t first = block*PLANE_BATCH_BLOCK_SIZE;
+            const size_t n = std::min((size_t)PLANE_BATCH_BLOCK_SIZE, imgs.size()-first);
+            typename PlaneBatch<T>::DistanceMatrix distances;
+            planes.distances(points, first, n, distances);
+
+            vector<int> frames;
+            vector<int> segments;
+            for(size_t f = 0; f < n; f++)
+            {
+                Plane3D plane = planes.getPlane(first+f);
+                const T tol = planes.tolerance(first+f, maxAbs);
+                const T* dist = distances.row(f).data();
+                // The matrix product sums in another order than Plane3D::getDistance(),
+                // so distances within rounding of zero are checked the same way as in intersect()
+                bool hit = false;
+                for(int i = 0; i < nSegments && (m_allCrossings || !hit); i++)
+                {
+                    const T d0 = dist[i];
+                    const T d1 = dist[i+1];
+                    if((d0 > tol && d1 > tol) || (d0 < -tol && d1 < -tol)) continue;
+                    if(crossesPlane(plane, i))
+                    {
+                        frames.push_back(first+f);
+                        segments.push_back(i);
+                        hit = true;
+                    }
+                }
+            }
+            intersectCandidates(imgs, planes, frames, segments, found);
+        });
+    }
+
+    /**
+   * Find the first segment crossing a plane.
+   * The search starts around a given segment, usually the crossing with the previous frame
+   * of a sweep. A crossing found there is the first one if the part of the curve before it
+   * is on one side of the plane, which is checked with a single bounding box.
+   * Only if that fails, or nothing is found nearby, the bounding volume hierarchy is searched,
+   * skipping the parts of the curve that are entirely on one side of the plane.
+   * @param plane The plane
+   * @param start The segment to search around first, negative to search the hierarchy right away
+   * @return the first segment i such that m_points[i] and m_points[i+1] are on opposite sides of the plane, or -1
+   */
+    int
+    findCrossingSegment(const Plane3D& plane, int start) const
+    {
+        auto crosses = [&](int i){ return crossesPlane(plane, i); };
+        if(start < 0) return m_segments.findSegment(plane, crosses);
+
+        // Search outwards from the start position first
+        const int nSegments = (int)m_points[0].size()-1;
+        start = std::min(nSegments-1, start);
+        int pos = -1;
+        for(int d = 0; d <= INTERSECTION_SEARCH_WINDOW && pos < 0 && nSegments > 0; d++)
+        {
+            if(start-d >= 0 && crosses(start-d))
+                pos = start-d;
+            else if(d > 0 && start+d < nSegments && crosses(start+d))
+                pos = start+d;
+        }
+        if(pos > 0 && !m_segments.beforeIsClear(plane, pos))
+        {
+            // A crossing earlier along the curve takes precedence
+            int earlier = m_segments.findSegment(plane, crosses, 0, pos);
+            if(earlier >= 0) pos = earlier;
+        }
+        else if(pos < 0)
+        {
+            pos = m_segments.findSegment(plane, crosses);
+        }
+        return pos;
+    }
+
+    /**
+   * Intersect the curve with the planes of a set of frames at known segments,
+   * solving the quadratic equations of all of them at once with QuadraticRoots.
+   * Every root of a segment is a crossing, as the curve may cross a plane twice
+   * between two points. A candidate without roots is retried on the next segment, like
+   * in intersectSegment(), so the same crossing can be found by two candidates. The
+   * crossings of each frame are therefore sorted and merged, and only the first one is
+   * kept unless getAllCrossings() is set.
+   * @param imgs The frames
+   * @param planes The image planes of the frames
+   * @param frames The frame of each candidate, in increasing order
+   * @param segments The crossing segment of each candidate, see findCrossingSegment()
+   * @param found Receives the intersections of each frame, in order along the curve
+   */
+    void
+    intersectCandidates(const vector<MetaImage<inData_t> >& imgs, const PlaneBatch<T>& planes,
+                        const vector<int>& frames, vector<int> segments,
+                        vector<vector<Intersection<T> > >& found) const
+    {
+        // The roots are found in double precision whatever T is, see crossingCoefficients()
+        typedef QuadraticRoots<double>::Array Array;
+        typedef QuadraticRoots<double>::IndexArray IndexArray;
+        // The crossings as (frame, parameter position) pairs
+        vector<std::pair<int, double> > crossings;
+        vector<int> pending(frames.size());
+        for(size_t k = 0; k < pending.size(); k++)
+        {
+            pending[k] = k;
+        }
+        // The second round retries the next segment, as rounding errors may
+        // cause us to miss the 0-1 interval just slightly
+        for(int round = 0; round < 2 && !pending.empty(); round++)
+        {
+            const int n = pending.size();
+            Array a(n), b(n), c(n), root(n), second(n);
+            IndexArray count(n);
+            for(int k = 0; k < n; k++)
+            {
+                const int idx = pending[k];
+                crossingCoefficients(segments[idx], planes.getPlane(frames[idx]), a(k), b(k), c(k));
+            }
+            QuadraticRoots<double>::solve(a, b, c, root, second, count);
+
+            vector<int> retry;
+            for(int k = 0; k < n; k++)
+            {
+                const int idx = pending[k];
+                // Subtracting 0.5 because the spline is translated by 0.5 along the t axis.
+                if(count(k) > 0)
+                    crossings.push_back(std::make_pair(frames[idx], root(k) + segments[idx] - 0.5));
+                if(count(k) > 1)
+                    crossings.push_back(std::make_pair(frames[idx], second(k) + segments[idx] - 0.5));
+                if(count(k) == 0 && round == 0)
+                {
+                    segments[idx]++;
+                    retry.push_back(idx);
+                }
+            }
+            pending.swap(retry);
+        }
+
+        std::sort(crossings.begin(), crossings.end());
+        for(size_t k = 0; k < crossings.size(); k++)
+        {
+            const int frame = crossings[k].first;
+            const double t = crossings[k].second;
+            if(k > 0 && crossings[k-1].first == frame)
+            {
+                // Compared with the previous root, as a chain of nearly equal roots is one crossing
+                if(!m_allCrossings || t - crossings[k-1].second <= INTERSECTION_SAME_CROSSING) continue;
+            }
+            found[frame].push_back(makeIntersection(&imgs[frame], planes.getGeometry(frame), t));
+        }
+    }
+
+    /**
+   * @param plane The plane
+   * @param i Segment index
+   * @return true if m_points[i] and m_points[i+1] are on different sides of the plane
+   */
+    bool
+    crossesPlane(const Plane3D& plane, int i) const
+    {
+        double p0[3], p1[3];
+        for(int j = 0; j < 3; j++)
+        {
+            p0[j] = m_points[j][i];
+            p1[j] = m_points[j][i+1];
+        }
+        return sgn(plane.getDistance(p0)) != sgn(plane.getDistance(p1));
+    }
+
+protected:
+
+    /**
+   * Half of the binomial kernel equal to n applications of the mask {0.25, 0.50, 0.25}
+   * @param n Number of applications
+   * @return the weights C(2n, n+k)/4^n for k = 0, 1, ..., n, or up to the last weight
+   *         that matters if n is above SMOOTHING_FULL_KERNEL_MAX, see smooth()
+   */
+    static vector<T>
+    binomialKernel(int n)
+    {
+        // C(2n,n)/4^n = prod (2j-1)/(2j), and C(2n,n+k+1)/C(2n,n+k) = (n-k)/(n+k+1)
+        double weight = 1.0;
+        for(int j = 1; j <= n; j++)
+        {
+            weight *= (2.0*j-1.0)/(2.0*j);
+        }
+        const double negligible = n <= SMOOTHING_FULL_KERNEL_MAX ? 0.0 : std::numeric_limits<double>::epsilon()/1024;
+        vector<T> w;
+        for(int k = 0; k <= n && weight >= negligible; k++)
+        {
+            w.push_back(weight);
+            weight *= (double)(n-k)/(n+k+1);
+        }
+        return w;
+    }
+
+    /**
+   * Build the quadratic equation a t^2 + b t + c = 0 for the crossing between the plane and the curve near a segment
+   * The equation is built and solved in double precision whatever T is, as the
+   * discriminant suffers from cancellation close to a double root.
    *
    * @param p The position in m_points such that m_points[p] and m_points[p+1] are on opposite sides of the plane
    * @param plane The plane (from which we get the coefficients)
-   * @param roots The roots will be returned here
-   * @return the number of roots found
+   * @param a The second order coefficient is returned here
+   * @param b The first order coefficient is returned here
+   * @param c The constant term is returned here
    */
-    int findRoots(int p, Plane3D &plane, T roots[2]) const
+    void crossingCoefficients(int p, const Plane3D &plane, double& a, double& b, double& c) const
     {
-        assert(m_initialized == true);
-
         // p0_idx is an index into the interpolation point array,
         // we need to use control points to find the roots.
         p++;
-        T a = 0.0;
-        T b = 0.0;
-        T c = plane.getCoefficient(3);;
+        a = 0.0;
+        b = 0.0;
+        c = plane.getCoefficient(3);
 
         // Use the equation xS_x(t) + yS_y(t) + zS_z(t) - d = 0 to build
         // a 2nd order equation (we are using quadratic splines, so this exists)
@@ -578,29 +1217,48 @@ protected:
 
         for(int dim = 0; dim < 3; dim++)
         {
-            T a_tmp = m_cpoints[dim][p-1]*0.5
-                    - m_cpoints[dim][p]
-                    + m_cpoints[dim][p+1]*0.5;
+            const double cp0 = m_cpoints[dim][p-1];
+            const double cp1 = m_cpoints[dim][p];
+            const double cp2 = m_cpoints[dim][p+1];
+            double a_tmp = cp0*0.5
+                    - cp1
+                    + cp2*0.5;
             a_tmp *= plane.getCoefficient(dim);
 
             a += a_tmp;
 
-            T b_tmp = - m_cpoints[dim][p-1]
-                    + m_cpoints[dim][p];
+            double b_tmp = - cp0
+                    + cp1;
             b_tmp *= plane.getCoefficient(dim);
 
             b += b_tmp;
 
-            T c_tmp = m_cpoints[dim][p-1]*0.5
-                  + m_cpoints[dim][p]*0.5;
+            double c_tmp = cp0*0.5
+                  + cp1*0.5;
             c_tmp *= plane.getCoefficient(dim);
 
             c += c_tmp;
         }
+    }
+
+    /**
+   * Find the roots of the quadratic equation that can be built by inserting the basis functions into the plane equation
+   *
+   * @param p The position in m_points such that m_points[p] and m_points[p+1] are on opposite sides of the plane
+   * @param plane The plane (from which we get the coefficients)
+   * @param roots The roots will be returned here
+   * @return the number of roots found
+   */
+    int findRoots(int p, Plane3D &plane, double roots[2]) const
+    {
+        assert(m_initialized == true);
+
+        double a, b, c;
+        crossingCoefficients(p, plane, a, b, c);
         // Now we have a, b and c, and we can solve it using the standard formula for solving 2nd order equations
         // (-b +- sqrt(b^2-4ac))/2a
 
-        T d = b*b - 4*a*c;
+        double d = b*b - 4*a*c;
         // Roots are complex, we are not interested in those..
         // Actually this shouldn't happen
         if(d >= -0.01 && d < 0.0) d = 0.0;
@@ -617,7 +1275,7 @@ protected:
                 return 0;
         }
         else {
-            T r1, r2;
+            double r1, r2;
             r1 = (-b + sqrt(d))/(2.0*a);
             r2 = (-b - sqrt(d))/(2.0*a);
             int nroots = 0;
@@ -640,6 +1298,10 @@ protected:
     std::vector<T> m_points[3];
     /// The control points
     std::vector<T> m_cpoints[3];
+    /// m_power[i][k][s] is the coefficient of u^k along axis i of segment s, see computePowerBasis()
+    std::vector<T> m_power[3][3];
+    /// Bounding volumes of the segments between the points to interpolate
+    SegmentBVH<T> m_segments;
 
     /// The intersections (as filled by findAllIntersections)
     IntersectionSet<T> m_intersections;
@@ -648,6 +1310,8 @@ protected:
 
     /// Whether to transform when finding vector from plane matrix
     bool m_transform;
+    /// Whether findAllIntersections() reports every crossing with a frame
+    bool m_allCrossings;
     /// Which axis to use from plane matrix
     int m_axis;
 };
@@ -0,0 +1,199 @@
+#ifndef SPLINE_CACHE_HPP
+#define SPLINE_CACHE_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <vector>
+#include "spline3d.hpp"
+#include "frame_store.hpp"
+
+/**
+ * A bounded cache of the products of the centerline stages of AngleCorrectionT:
+ * the smoothed splines with their control points and, when they were computed,
+ * their intersections with a set of frames, including the region statistics.
+ *
+ * The entries are keyed by the hash of the centerline and the number of smoothing
+ * convolutions, and the least recently used entry is dropped when the cache is full.
+ * Intersections refer to the frames they were found in, so the entry only holds a weak
+ * pointer to the frames, and its intersections are only valid for those same frames.
+ */
+template<typename T>
+class SplineCache
+{
+public:
+    typedef std::vector<Spline3D<T> > SplineVector;
+
+    /// Number of entries kept by default
+    static const size_t DEFAULT_CAPACITY = 8;
+
+    /**
+   * One cached result
+   */
+    struct Entry
+    {
+        /// Hash of the centerline, see hashCenterline()
+        uint64_t centerline;
+        /// Number of smoothing convolutions
+        int nConvolutions;
+        /// The smoothed and fitted splines, with their intersections
+        SplineVector splines;
+        /// The frames the intersections were found in
+        std::weak_ptr<const FrameStore> frames;
+        /// Whether the intersections are all crossings, see Spline3D::setAllCrossings()
+        bool allCrossings;
+
+        /**
+       * @param currentFrames The frames in use
+       * @param currentAllCrossings Whether all crossings are used
+       * @return true if the intersections of the splines are the ones for the given frames
+       */
+        bool
+        hasIntersections(const FrameStore::Ptr& currentFrames, bool currentAllCrossings) const
+        {
+            return currentFrames && frames.lock() == currentFrames && allCrossings == currentAllCrossings;
+        }
+    };
+
+    /**
+   * Constructor
+   * @param capacity Maximum number of entries
+   */
+    SplineCache(size_t capacity = DEFAULT_CAPACITY)
+    {
+        m_capacity = capacity;
+        m_hits = 0;
+        m_misses = 0;
+    }
+
+    /**
+   * Find the entry of a centerline and smoothing level, and mark it as the most recently used.
+   * Counts a hit or a miss.
+   * @param centerline Hash of the centerline
+   * @param nConvolutions Number of smoothing convolutions
+   * @return the entry, valid until the next call to store(), or NULL if there is none
+   */
+    const Entry*
+    lookup(uint64_t centerline, int nConvolutions)
+    {
+        for(auto it = m_entries.begin(); it != m_entries.end(); ++it)
+        {
+            if(it->centerline == centerline && it->nConvolutions == nConvolutions)
+            {
+                m_entries.splice(m_entries.begin(), m_entries, it);
+                m_hits++;
+                return &m_entries.front();
+            }
+        }
+        m_misses++;
+        return NULL;
+    }
+
+    /**
+   * Store a copy of the splines of a centerline and smoothing level, replacing any
+   * previous entry for them, and drop the least recently used entry if the cache is full
+   * @param centerline Hash of the centerline
+   * @param nConvolutions Number of smoothing convolutions
+   * @param splines The smoothed and fitted splines, with their intersections
+   * @param frames The frames the intersections were found in
+   * @param allCrossings Whether the intersections are all crossings
+   */
+    void
+    store(uint64_t centerline, int nConvolutions, const SplineVector& splines,
+          const FrameStore::Ptr& frames, bool allCrossings)
+    {
+        if(m_capacity == 0) return;
+        for(auto it = m_entries.begin(); it != m_entries.end(); ++it)
+        {
+            if(it->centerline == centerline && it->nConvolutions == nConvolutions)
+            {
+                m_entries.erase(it);
+                break;
+            }
+        }
+        m_entries.push_front(Entry());
+        Entry& entry = m_entries.front();
+        entry.centerline = centerline;
+        entry.nConvolutions = nConvolutions;
+        entry.splines = splines;
+        entry.frames = frames;
+        entry.allCrossings = allCrossings;
+        trim();
+    }
+
+    /**
+   * Set the maximum number of entries, dropping the least recently used ones if needed.
+   * 0 turns the cache off.
+   * @param capacity Maximum number of entries
+   */
+    void
+    setCapacity(size_t capacity)
+    {
+        m_capacity = capacity;
+        trim();
+    }
+
+    /**
+   * @return the maximum number of entries
+   */
+    size_t
+    getCapacity() const
+    {
+        return m_capacity;
+    }
+
+    /**
+   * @return the number of entries
+   */
+    size_t
+    size() const
+    {
+        return m_entries.size();
+    }
+
+    /**
+   * Drop all entries
+   */
+    void
+    clear()
+    {
+        m_entries.clear();
+    }
+
+    /**
+   * @return the number of lookups that found an entry
+   */
+    size_t
+    getHits() const
+    {
+        return m_hits;
+    }
+
+    /**
+   * @return the number of lookups that did not find an entry
+   */
+    size_t
+    getMisses() const
+    {
+        return m_misses;
+    }
+
+private:
+    void
+    trim()
+    {
+        while(m_entries.size() > m_capacity)
+        {
+            m_entries.pop_back();
+        }
+    }
+
+    /// The entries, the most recently used first
+    std::list<Entry> m_entries;
+    size_t m_capacity;
+    size_t m_hits;
+    size_t m_misses;
+};
+
+#endif // SPLINE_CACHE_HPP
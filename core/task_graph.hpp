@@ -0,0 +1,190 @@
+#ifndef TASK_GRAPH_HPP
+#define TASK_GRAPH_HPP
+
+#include <atomic>
+#include <cassert>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "task_scheduler.hpp"
+
+/**
+ * A dependency graph of computation stages.
+ *
+ * Every node is a function producing some intermediate result from the results of
+ * the nodes it depends on. A node is dirty when its result is out of date, and
+ * invalidating a node also invalidates everything depending on it.
+ * execute() runs the dirty nodes only, starting a node as soon as all its dirty
+ * dependencies are done, so independent nodes run concurrently on the TaskScheduler.
+ *
+ * If a node throws, it stays dirty, none of its dependents are run, and the first
+ * exception is rethrown by execute() once the running nodes have finished.
+ */
+class TaskGraph
+{
+public:
+    typedef int NodeId;
+    typedef std::function<void()> NodeFunction;
+
+    /**
+   * Add a node to the graph. New nodes are dirty.
+   * Dependencies must already be in the graph, so the graph can not have cycles.
+   * @param name Name of the node, for logging
+   * @param function The function computing the result of the node
+   * @param dependencies The nodes whose results are used by function
+   * @return id of the new node
+   */
+    NodeId
+    addNode(const std::string& name, const NodeFunction& function, const std::vector<NodeId>& dependencies = std::vector<NodeId>())
+    {
+        Node node;
+        node.name = name;
+        node.function = function;
+        node.dependencies = dependencies;
+        node.dirty = true;
+        NodeId id = m_nodes.size();
+        for(NodeId dep: dependencies)
+        {
+            assert(dep >= 0 && dep < id);
+            m_nodes[dep].dependents.push_back(id);
+        }
+        m_nodes.push_back(node);
+        return id;
+    }
+
+    /**
+   * Mark a node and everything depending on it as dirty
+   * @param id Node to invalidate
+   */
+    void
+    invalidate(NodeId id)
+    {
+        if(m_nodes[id].dirty) return;
+        m_nodes[id].dirty = true;
+        for(NodeId dependent: m_nodes[id].dependents)
+        {
+            invalidate(dependent);
+        }
+    }
+
+    /**
+   * Mark all nodes as dirty
+   */
+    void
+    invalidateAll()
+    {
+        for(auto &node: m_nodes)
+        {
+            node.dirty = true;
+        }
+    }
+
+    /**
+   * @param id Node to check
+   * @return true if the result of the node is out of date
+   */
+    bool
+    isDirty(NodeId id) const
+    {
+        return m_nodes[id].dirty;
+    }
+
+    /**
+   * @param id Node id
+   * @return the name of the node
+   */
+    const std::string&
+    getName(NodeId id) const
+    {
+        return m_nodes[id].name;
+    }
+
+    /**
+   * @return number of nodes in the graph
+   */
+    size_t
+    size() const
+    {
+        return m_nodes.size();
+    }
+
+    /**
+   * Run all dirty nodes, respecting the dependencies
+   * @param scheduler The scheduler to run the nodes on
+   * @return the ids of the nodes that were run, in the order they finished
+   */
+    std::vector<NodeId>
+    execute(TaskScheduler& scheduler = TaskScheduler::instance())
+    {
+        const int n = m_nodes.size();
+
+        // Number of dirty dependencies each dirty node is waiting for
+        std::unique_ptr<std::atomic<int>[]> waiting(new std::atomic<int>[n]);
+        for(int i = 0; i < n; i++)
+        {
+            int count = 0;
+            for(NodeId dep: m_nodes[i].dependencies)
+            {
+                if(m_nodes[dep].dirty) count++;
+            }
+            waiting[i] = count;
+        }
+
+        std::vector<NodeId> done;
+        std::mutex doneMutex;
+        TaskGroup group(scheduler);
+
+        std::function<void(NodeId)> start = [&](NodeId id)
+        {
+            group.run([&, id]()
+            {
+                m_nodes[id].function();
+                {
+                    std::lock_guard<std::mutex> lock(doneMutex);
+                    m_nodes[id].dirty = false;
+                    done.push_back(id);
+                }
+                for(NodeId dependent: m_nodes[id].dependents)
+                {
+                    if(--waiting[dependent] == 0)
+                    {
+                        start(dependent);
+                    }
+                }
+            });
+        };
+
+        // Collect the nodes that can start right away before starting any of them,
+        // the running nodes start their dependents themselves
+        std::vector<NodeId> ready;
+        for(int i = 0; i < n; i++)
+        {
+            if(m_nodes[i].dirty && waiting[i] == 0)
+            {
+                ready.push_back(i);
+            }
+        }
+        for(NodeId id: ready)
+        {
+            start(id);
+        }
+        group.wait();
+        return done;
+    }
+
+private:
+    struct Node
+    {
+        std::string name;
+        NodeFunction function;
+        std::vector<NodeId> dependencies;
+        std::vector<NodeId> dependents;
+        bool dirty;
+    };
+
+    std::vector<Node> m_nodes;
+};
+
+#endif // TASK_GRAPH_HPP
@@ -0,0 +1,213 @@
+#include "task_scheduler.hpp"
+
+#include <cstdlib>
+
+/**
+* Implementation of TaskScheduler and TaskGroup
+*
+*/
+
+namespace
+{
+// Index of the queue owned by the current thread, -1 for threads that are not workers
+thread_local int tl_queue = -1;
+thread_local const TaskScheduler* tl_scheduler = NULL;
+
+unsigned int defaultNumberOfThreads()
+{
+    const char* env = std::getenv("ANGLECORR_NUM_THREADS");
+    if(env)
+    {
+        int n = std::atoi(env);
+        if(n > 0) return n;
+    }
+    unsigned int n = std::thread::hardware_concurrency();
+    return n > 0 ? n : 1;
+}
+}
+
+
+TaskScheduler::TaskScheduler(unsigned int nThreads):
+    m_pending(0),
+    m_stop(false)
+{
+    if(nThreads == 0) nThreads = defaultNumberOfThreads();
+
+    // One queue per worker, and the injection queue for other threads last
+    for(unsigned int i = 0; i < nThreads; i++)
+    {
+        m_queues.push_back(std::unique_ptr<WorkQueue>(new WorkQueue()));
+    }
+    for(unsigned int i = 0; i+1 < nThreads; i++)
+    {
+        m_workers.push_back(std::thread(&TaskScheduler::workerLoop, this, i));
+    }
+}
+
+
+TaskScheduler::~TaskScheduler()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_sleepMutex);
+        m_stop = true;
+    }
+    m_wakeup.notify_all();
+    for(auto &worker: m_workers)
+    {
+        worker.join();
+    }
+}
+
+
+TaskScheduler& TaskScheduler::instance()
+{
+    static TaskScheduler scheduler;
+    return scheduler;
+}
+
+
+int TaskScheduler::currentQueue() const
+{
+    if(tl_scheduler == this) return tl_queue;
+    return m_queues.size()-1;
+}
+
+
+void TaskScheduler::push(const Job& job)
+{
+    WorkQueue& queue = *m_queues[currentQueue()];
+    {
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        queue.jobs.push_back(job);
+    }
+    m_pending++;
+    // Taking the lock makes sure a worker that just found nothing to do is
+    // either already waiting, or will see m_pending > 0
+    {
+        std::lock_guard<std::mutex> lock(m_sleepMutex);
+    }
+    m_wakeup.notify_one();
+}
+
+
+bool TaskScheduler::popLocal(int queue, Job& job)
+{
+    WorkQueue& q = *m_queues[queue];
+    std::lock_guard<std::mutex> lock(q.mutex);
+    if(q.jobs.empty()) return false;
+    job = q.jobs.back();
+    q.jobs.pop_back();
+    return true;
+}
+
+
+bool TaskScheduler::steal(int thief, Job& job)
+{
+    const int n = m_queues.size();
+    for(int k = 1; k < n; k++)
+    {
+        WorkQueue& q = *m_queues[(thief+k) % n];
+        std::lock_guard<std::mutex> lock(q.mutex);
+        if(q.jobs.empty()) continue;
+        job = q.jobs.front();
+        q.jobs.pop_front();
+        return true;
+    }
+    return false;
+}
+
+
+void TaskScheduler::execute(Job& job)
+{
+    m_pending--;
+    std::exception_ptr error;
+    try {
+        job.task();
+    } catch (...) {
+        error = std::current_exception();
+    }
+    job.group->finished(error);
+}
+
+
+bool TaskScheduler::tryRunOne()
+{
+    Job job;
+    int queue = currentQueue();
+    if(popLocal(queue, job) || steal(queue, job))
+    {
+        execute(job);
+        return true;
+    }
+    return false;
+}
+
+
+void TaskScheduler::workerLoop(int idx)
+{
+    tl_scheduler = this;
+    tl_queue = idx;
+    while(true)
+    {
+        if(tryRunOne()) continue;
+
+        std::unique_lock<std::mutex> lock(m_sleepMutex);
+        m_wakeup.wait(lock, [this](){ return m_stop || m_pending > 0; });
+        if(m_stop) return;
+    }
+}
+
+
+TaskGroup::TaskGroup(TaskScheduler& scheduler):
+    m_scheduler(scheduler),
+    m_pending(0)
+{
+}
+
+
+TaskGroup::~TaskGroup()
+{
+    try {
+        wait();
+    } catch (...) {
+    }
+}
+
+
+void TaskGroup::run(const TaskScheduler::Task& task)
+{
+    m_pending++;
+    TaskScheduler::Job job;
+    job.task = task;
+    job.group = this;
+    m_scheduler.push(job);
+}
+
+
+void TaskGroup::wait()
+{
+    while(m_pending > 0)
+    {
+        if(!m_scheduler.tryRunOne())
+        {
+            std::this_thread::yield();
+        }
+    }
+    std::exception_ptr error;
+    {
+        std::lock_guard<std::mutex> lock(m_errorMutex);
+        std::swap(error, m_error);
+    }
+    if(error) std::rethrow_exception(error);
+}
+
+
+void TaskGroup::finished(std::exception_ptr error)
+{
+    if(error)
+    {
+        std::lock_guard<std::mutex> lock(m_errorMutex);
+        if(!m_error) m_error = error;
+    }
+    m_pending--;
+}
@@ -0,0 +1,186 @@
+#ifndef TASK_SCHEDULER_HPP
+#define TASK_SCHEDULER_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class TaskGroup;
+
+/**
+ * A work-stealing task scheduler.
+ *
+ * Every worker thread owns a double-ended queue of tasks. A worker pushes and pops
+ * tasks at the back of its own queue (LIFO, cache friendly), and when it runs out
+ * of work it steals from the front of the other queues (FIFO, which hands out the
+ * oldest and thereby largest pieces of a recursively split range).
+ * Threads that are not workers push into a separate injection queue.
+ *
+ * Waiting for a TaskGroup never blocks a thread: the waiting thread keeps executing
+ * tasks until the group is done, so task groups may be nested freely.
+ *
+ * The number of threads defaults to std::thread::hardware_concurrency() and can be
+ * overridden with the environment variable ANGLECORR_NUM_THREADS.
+ */
+class TaskScheduler
+{
+public:
+    typedef std::function<void()> Task;
+
+    /**
+   * Constructor
+   * @param nThreads Total number of threads taking part in the computations,
+   *        including the thread waiting for the result. 0 means automatic.
+   */
+    explicit TaskScheduler(unsigned int nThreads = 0);
+
+    /**
+   * Destructor
+   * Stops and joins all worker threads
+   */
+    ~TaskScheduler();
+
+    /**
+   * Get the process wide scheduler used by the AngleCorrection pipeline
+   * @return the global scheduler
+   */
+    static TaskScheduler& instance();
+
+    /**
+   * @return number of threads taking part in the computations
+   */
+    unsigned int getNumberOfThreads() const
+    {
+        return m_workers.size()+1;
+    }
+
+    /**
+   * Run f(i) for every i in [begin, end).
+   * The range is split recursively into tasks of at most grain indices,
+   * which are distributed over the threads by work stealing.
+   * Returns when all iterations are done. The first exception thrown by f is rethrown.
+   * @param begin first index
+   * @param end one past the last index
+   * @param f function to call for each index
+   * @param grain the maximal number of indices handled by a single task
+   */
+    template<typename F>
+    void parallelFor(size_t begin, size_t end, const F& f, size_t grain = 1);
+
+private:
+    friend class TaskGroup;
+
+    struct Job
+    {
+        Task task;
+        TaskGroup* group;
+    };
+
+    struct WorkQueue
+    {
+        std::mutex mutex;
+        std::deque<Job> jobs;
+    };
+
+    void push(const Job& job);
+    bool tryRunOne();
+    bool popLocal(int queue, Job& job);
+    bool steal(int thief, Job& job);
+    void execute(Job& job);
+    void workerLoop(int idx);
+    int currentQueue() const;
+
+    std::vector<std::unique_ptr<WorkQueue> > m_queues;
+    std::vector<std::thread> m_workers;
+    std::atomic<int> m_pending;
+    std::atomic<bool> m_stop;
+    std::mutex m_sleepMutex;
+    std::condition_variable m_wakeup;
+};
+
+
+/**
+ * A set of tasks that can be waited for as a whole
+ */
+class TaskGroup
+{
+public:
+    /**
+   * Constructor
+   * @param scheduler the scheduler to run the tasks on
+   */
+    explicit TaskGroup(TaskScheduler& scheduler = TaskScheduler::instance());
+
+    /**
+   * Destructor. Waits for any remaining tasks, but swallows their exceptions
+   */
+    ~TaskGroup();
+
+    /**
+   * Schedule a task
+   * @param task The task to run
+   */
+    void run(const TaskScheduler::Task& task);
+
+    /**
+   * Wait for all scheduled tasks to finish, executing tasks while waiting.
+   * Rethrows the first exception thrown by any of the tasks.
+   */
+    void wait();
+
+private:
+    friend class TaskScheduler;
+    TaskGroup(const TaskGroup&);
+    TaskGroup& operator=(const TaskGroup&);
+
+    void finished(std::exception_ptr error);
+
+    TaskScheduler& m_scheduler;
+    std::atomic<int> m_pending;
+    std::mutex m_errorMutex;
+    std::exception_ptr m_error;
+};
+
+
+template<typename F>
+void TaskScheduler::parallelFor(size_t begin, size_t end, const F& f, size_t grain)
+{
+    if(end <= begin) return;
+    if(grain < 1) grain = 1;
+    if(end-begin <= grain || m_workers.empty())
+    {
+        for(size_t i = begin; i < end; i++)
+        {
+            f(i);
+        }
+        return;
+    }
+
+    TaskGroup group(*this);
+    // Splits [b,e) in halves, hands the upper half to the scheduler and keeps
+    // on splitting the lower half until it is small enough to run directly
+    std::function<void(size_t, size_t)> split = [&](size_t b, size_t e)
+    {
+        while(e-b > grain)
+        {
+            size_t mid = b + (e-b)/2;
+            group.run([&split, mid, e](){ split(mid, e); });
+            e = mid;
+        }
+        for(size_t i = b; i < e; i++)
+        {
+            f(i);
+        }
+    };
+    group.run([&split, begin, end](){ split(begin, end); });
+    group.wait();
+}
+
+#endif // TASK_SCHEDULER_HPP
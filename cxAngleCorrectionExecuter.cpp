@@ -2,6 +2,7 @@
 #include "cxLogger.h"
 
 #include "cxForwardDeclarations.h"
+#include <atomic>
 
 namespace cx
 {
@@ -42,7 +43,13 @@ bool AngleCorrectionExecuter::calculate(bool reportOutSuccess)
     if(reportOutSuccess) report(QString("Algorithm Angle correction started."));
     bool res= false;
     try {
-        res=AngleCorrection::calculate();
+        // Already on the thread of the algorithm, report the progress from it in steps of 0.1%
+        std::atomic<int> shown(-1);
+        res = AngleCorrection::calculate([this, &shown](int done, int total)
+        {
+            const int permille = total > 0 ? (int)(1000LL*done/total) : 0;
+            if(shown.exchange(permille) != permille) emit progressChanged(done, total);
+        });
     } catch (std::exception& e){
         reportError("std::exception in angle correction algorithm: "+qstring_cast(e.what()));
     } catch (...){
@@ -54,6 +61,8 @@ bool AngleCorrectionExecuter::calculate(bool reportOutSuccess)
         if(getIntersections() <1) text.append(QString("\n Found %1 interesections. Maybe <<Max angle cut off>> should be lower?").arg(getIntersections()));
         if(getNumOfStepsRan() <1) text.append("\n Same input as previous. No new data generated.");
         if(reportOutSuccess) reportSuccess(text);
+    }else if(wasCancelled()){
+        report(QString("Algorithm Angle correction cancelled [%1s].").arg(this->getSecondsPassedAsString()));
     }else{
         QString text =QString("Algorithm Angle correction failed [%1s].").arg(this->getSecondsPassedAsString());
         reportError(text);
@@ -61,6 +70,11 @@ bool AngleCorrectionExecuter::calculate(bool reportOutSuccess)
     return res;
 }
 
+void AngleCorrectionExecuter::cancel()
+{
+    AngleCorrection::cancel();
+}
+
 
 void AngleCorrectionExecuter::postProcessingSlot()
 {
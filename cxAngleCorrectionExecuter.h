@@ -33,6 +33,11 @@ public:
   int getNumOfStepsRan(){return AngleCorrection::getNumOfStepsRan();}
   virtual bool calculate(bool reportOutSuccess);
   virtual bool calculate(){return calculate(true);}
+  bool wasCancelled() const {return AngleCorrection::wasCancelled();}
+public slots:
+  void cancel();
+signals:
+  void progressChanged(int value, int maximum);
 private slots:
   virtual void postProcessingSlot();
 
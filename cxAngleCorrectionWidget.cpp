@@ -46,6 +46,7 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include "Exceptions.hpp"
 #include <QDir>
 #include <QLabel>
+#include <QProgressBar>
 #include <QVBoxLayout>
 
 
@@ -88,6 +89,11 @@ AngleCorrectionWidget::AngleCorrectionWidget(VisServicesPtr visServices, QWidget
 	connect(mRunAngleCorrButton, &QPushButton::clicked, this, &AngleCorrectionWidget::runAngleCorection);
 	mVerticalLayout->addWidget(mRunAngleCorrButton);
 
+    mCancelButton = new QPushButton("Cancel", this);
+    mCancelButton->setToolTip("Stop the running angle correction");
+    mCancelButton->setEnabled(false);
+    mVerticalLayout->addWidget(mCancelButton);
+
     mOutDataSelectWidget =   StringPropertySelectMesh::New(mVisServices->patient());
     mOutDataSelectWidget->setUidRegexp("angleCorr"); 
 	mOutDataSelectWidget->setValueName("Output: ");
@@ -96,9 +102,11 @@ AngleCorrectionWidget::AngleCorrectionWidget(VisServicesPtr visServices, QWidget
     mExecuter.reset(new AngleCorrectionExecuter());
 	connect(mExecuter.get(), SIGNAL(finished()), this, SLOT(executionFinished()));
 	connect(mExecuter.get(), SIGNAL(aboutToStart()), this, SLOT(preprocessExecuter()));
-    mTimedAlgorithmProgressBar = new cx::TimedAlgorithmProgressBar;
-	mTimedAlgorithmProgressBar->attach(mExecuter);
-	mVerticalLayout->addWidget(mTimedAlgorithmProgressBar);
+    connect(mExecuter.get(), SIGNAL(progressChanged(int, int)), this, SLOT(progressChangedSlot(int, int)));
+    connect(mCancelButton, &QPushButton::clicked, mExecuter.get(), &AngleCorrectionExecuter::cancel);
+    mProgressBar = new QProgressBar(this);
+    mProgressBar->setVisible(false);
+    mVerticalLayout->addWidget(mProgressBar);
 
 	mVerticalLayout->addStretch();
 
@@ -308,6 +316,18 @@ void AngleCorrectionWidget::preprocessExecuter()
 {
     setInput();
     mRunAngleCorrButton->setEnabled(false);
+    mCancelButton->setEnabled(true);
+    // Busy indicator until the amount of work is known
+    mProgressBar->setRange(0, 0);
+    mProgressBar->setValue(0);
+    mProgressBar->setVisible(true);
+}
+
+void AngleCorrectionWidget::progressChangedSlot(int value, int maximum)
+{
+    if(maximum <= 0) return;
+    mProgressBar->setRange(0, maximum);
+    mProgressBar->setValue(value);
 }
 
 void AngleCorrectionWidget::runAngleCorection()
@@ -318,6 +338,12 @@ void AngleCorrectionWidget::runAngleCorection()
 void AngleCorrectionWidget::executionFinished()
 {
     mRunAngleCorrButton->setEnabled(true);
+    mCancelButton->setEnabled(false);
+    mProgressBar->setVisible(false);
+    if(mExecuter->wasCancelled())
+    {
+        return;
+    }
     vtkSmartPointer<vtkPolyData> output = mExecuter->getOutput();
     if(output==NULL)
     {
@@ -40,7 +40,6 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include "cxFileSelectWidget.h"
 #include "cxDataSelectWidget.h"
 #include "cxUSAcqusitionWidget.h"
-#include "cxTimedAlgorithmProgressBar.h"
 #include "cxPatientModelServiceProxy.h"
 #include "cxXmlOptionItem.h"
 #include "cxSelectDataStringProperty.h"
@@ -48,6 +47,7 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 
 class QVBoxLayout;
+class QProgressBar;
 
 namespace cx
 {
@@ -89,6 +89,7 @@ public slots:
 private slots:
 	void preprocessExecuter();
 	void executionFinished();
+    void progressChangedSlot(int value, int maximum);
     void step1ParamChangedSlot();
     void step2ParamChangedSlot();
 
@@ -104,6 +105,7 @@ private:
 	QString defaultWhatsThis() const;
 	QVBoxLayout*  mVerticalLayout;
     QPushButton* mRunAngleCorrButton;
+    QPushButton* mCancelButton;
     QWidget* createOptionsWidget();
     QWidget* mOptionsWidget;
 
@@ -116,7 +118,7 @@ private:
     MeshPtr mOutData;
 
     StringPropertySelectMeshPtr mOutDataSelectWidget;
-	TimedAlgorithmProgressBar* mTimedAlgorithmProgressBar;
+    QProgressBar* mProgressBar;
 
 	AngleCorrectionExecuterPtr mExecuter;
 